@@ -39,6 +39,8 @@
 typedef struct u_chan u_chan;
 typedef struct u_chanuser u_chanuser;
 typedef struct u_cu_pfx u_cu_pfx;
+typedef struct u_chan_recips u_chan_recips;
+typedef struct u_chan_route u_chan_route;
 
 #include "chan.h"
 #include "user.h"
@@ -47,25 +49,69 @@ typedef struct u_cu_pfx u_cu_pfx;
 struct u_chan {
 	u_ts_t ts;
 	char name[MAXCHANNAME+1];
+	u_hash_ent name_ent;
 	char topic[MAXTOPICLEN+1];
 	char topic_setter[MAXNICKLEN+1];
 	u_ts_t topic_time;
 	uint mode, flags;
 	u_cookie ck_flags;
-	u_map *members;
+	u_chanuser **members; /* in no particular order */
+	int nmembers, members_alloc;
+	u_map *member_index; /* u_user* -> u_chanuser*, for lookups */
 	mowgli_list_t ban, quiet, banex, invex;
 	u_map *invites;
 	char *forward, *key;
 	int limit;
+
+	/* how many members are local, and how many remote members are
+	   behind each local server link */
+	int nlocal;
+	u_chan_route *routes;
+	int nroutes, routes_alloc;
+
+	/* built on demand by u_chan_recips_get, dropped whenever the set
+	   of recipient links changes */
+	u_chan_recips *recips;
+};
+
+struct u_chan_route {
+	u_link *link;
+	int count;
 };
 
+/* The distinct links a channel message has to be written to: one per
+   local member, followed by one per server link that leads to remote
+   members. A broadcast scans this instead of walking the member list.
+   It is reference counted so a broadcast can keep using it even if
+   membership changes while the broadcast is going on. */
+struct u_chan_recips {
+	uint refs;
+	int nusers; /* links[0..nusers) are local users */
+	int nlinks; /* links[nusers..nlinks) are servers */
+	u_link *links[];
+};
+
+/* A membership is a single object, listed in both c->members and
+   u->channels. ci and ui are its positions in those arrays, so it can
+   be removed from both in constant time by moving the last entry of
+   each into its place. The arrays are for walking; lookups go through
+   c->member_index. */
 struct u_chanuser {
 	uint flags;
 	u_cookie ck_flags;
 	u_chan *c;
 	u_user *u;
+	int ci, ui;
 };
 
+/* Walks a channel's members or a user's channels. The body must not add
+   or remove memberships of what's being walked, since removal moves the
+   last entry into the hole. */
+#define U_CHAN_EACH_MEMBER(C, I, CU) \
+	for ((I)=0; (I)<(C)->nmembers && ((CU)=(C)->members[(I)], 1); (I)++)
+#define U_USER_EACH_CHAN(U, I, CU) \
+	for ((I)=0; (I)<(U)->nchannels && ((CU)=(U)->channels[(I)], 1); (I)++)
+
 struct u_cu_pfx {
 	mowgli_node_t n;
 
@@ -74,7 +120,8 @@ struct u_cu_pfx {
 	char prefix;
 };
 
-extern mowgli_patricia_t *all_chans;
+extern mowgli_patricia_t *all_chans; /* for walking all channels */
+extern u_hash chan_index; /* for lookups */
 
 extern u_mode_info cmode_infotab[128];
 extern u_mode_ctx cmodes;
@@ -113,6 +160,10 @@ extern u_chanuser *u_chan_user_add(u_chan*, u_user*);
 extern void u_chan_user_del(u_chanuser*);
 extern u_chanuser *u_chan_user_find(u_chan*, u_user*);
 
+/* returns a new reference, to be released with u_chan_recips_unref */
+extern u_chan_recips *u_chan_recips_get(u_chan*);
+extern void u_chan_recips_unref(u_chan_recips*);
+
 extern int u_entry_blocked(u_chan*, u_user*, char *key);
 extern u_chan *u_find_forward(u_chan*, u_user*, char *key);
 extern int u_is_muted(u_chanuser*);
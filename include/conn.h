@@ -12,6 +12,7 @@
 typedef struct u_conn_ctx u_conn_ctx;
 typedef enum u_conn_state u_conn_state;
 typedef struct u_conn u_conn;
+typedef struct u_conn_stats u_conn_stats;
 
 struct u_conn_ctx {
 	void (*attach)(u_conn*);
@@ -58,24 +59,51 @@ struct u_conn {
 	u_conn_state state;
 
 	mowgli_eventloop_pollable_t *poll;
+
+	/* set instead of poll for connections whose socket is owned by an
+	   I/O thread. input it has handed over waits in io_in until read,
+	   and io_queued counts output handed over but not yet written */
+	u_io_conn *io;
+	u_io_msg *io_in, *io_in_last;
+	size_t io_queued;
+	bool io_eof;
+
 	char ip[INET6_ADDRSTRLEN];
 	char host[U_CONN_HOSTSIZE];
 	mowgli_dns_query_t *dnsq;
 
 	u_sendq sendq;
+	ulong write_gen;
+	uint out_lines; /* queued since the last write */
+
+	/* set while on the list of connections whose data_ready callback
+	   will be run again at the end of the loop iteration */
+	bool input_pending;
+	mowgli_node_t input_n;
+
+	/* set while on the list of connections whose output is written
+	   and poll interest updated before the poller runs again */
+	bool dirty;
+	mowgli_node_t dirty_n;
 
 	u_conn_ctx *ctx;
 	void *priv;
 };
 
+/* returns NULL with errno set to EAGAIN if no connection is waiting */
 extern u_conn *u_conn_accept(mowgli_eventloop_t*, u_conn_ctx*, void*,
                              ulong flags, int listener);
 
+/* takes over a connection accepted by an I/O thread */
+extern u_conn *u_conn_adopt(u_conn_ctx*, void*, u_io_conn*,
+                            const struct sockaddr*, socklen_t);
+
 extern u_conn *u_conn_connect(mowgli_eventloop_t*, u_conn_ctx*, void*,
                               ulong flags, const struct sockaddr*, socklen_t);
 
 extern void u_conn_shut_down(u_conn*);
 
+/* returns -1 with errno set to EAGAIN if there is nothing to read */
 extern ssize_t u_conn_recv(u_conn*, uchar*, size_t sz);
 extern ssize_t u_conn_send(u_conn*, const uchar*, size_t sz);
 
@@ -83,8 +111,44 @@ extern ssize_t u_conn_send(u_conn*, const uchar*, size_t sz);
 extern uchar *u_conn_get_send_buffer(u_conn*, size_t sz);
 extern size_t u_conn_end_send_buffer(u_conn*, size_t sz);
 
+/* queues a shared buffer by reference */
+extern size_t u_conn_put_shared(u_conn*, u_sendq_buf*);
+
 extern void u_conn_sendq_clear(u_conn*);
 
+/* everything queued and not yet written, including output handed over
+   to an I/O thread */
+extern size_t u_conn_queued(u_conn*);
+
+/* asks for data_ready to be called again once every other connection
+   has had its turn in the current loop iteration, for contexts that
+   stopped reading before the socket was drained */
+extern void u_conn_resume_input(u_conn*);
+
+/* interest_requests counts every time a connection asked for its poll
+   interest to be updated, and interest_changes counts the updates that
+   actually reached the poller. The difference was saved by coalescing
+   updates once per loop iteration. */
+struct u_conn_stats {
+	ulong interest_requests;
+	ulong interest_changes;
+	ulong flushes;
+
+	/* output batched over a loop iteration and written at its end */
+	ulong output_writes, output_lines, output_lines_peak;
+
+	ulong accepts;
+	ulong accepts_this_sec, accepts_last_sec, accepts_peak_sec;
+	u_ts_t accept_ts;
+
+	/* dead connections waiting to be torn down */
+	ulong cleanup_depth, cleanup_peak;
+	ulong cleanups;
+	int conn_pool_size;
+};
+
+extern void u_conn_get_stats(u_conn_stats*);
+
 extern void u_conn_run(mowgli_eventloop_t *ev);
 
 extern int init_conn(void);
@@ -0,0 +1,38 @@
+/* ircd-micro, hash.h -- casemapped name index
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_HASH_H__
+#define __INC_HASH_H__
+
+typedef struct u_hash u_hash;
+typedef struct u_hash_ent u_hash_ent;
+
+/* Lives in the object being indexed, and keeps the hash of its name so
+   growing the table never rereads names. key must point at storage that
+   stays put while the entry is in the table, normally the object's own
+   name field. */
+struct u_hash_ent {
+	u_hash_ent *next;
+	uint hash;
+	char *key;
+	void *data;
+};
+
+struct u_hash {
+	char *casemap;
+	u_hash_ent **buckets;
+	uint size, count;
+};
+
+extern void u_hash_init(u_hash*, char *casemap);
+
+/* like mowgli_patricia_add, does nothing and returns false if an entry
+   with an equivalent key is already present */
+extern bool u_hash_add(u_hash*, u_hash_ent*, char *key, void *data);
+extern void u_hash_del(u_hash*, u_hash_ent*);
+extern void *u_hash_get(u_hash*, const char *key);
+
+#endif
@@ -0,0 +1,44 @@
+/* ircd-micro, ibuf.h -- line input buffers
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_IBUF_H__
+#define __INC_IBUF_H__
+
+typedef struct u_ibuf u_ibuf;
+
+/* Data lives in data[start..end). Lines are consumed by advancing start,
+   and remaining data is only moved back to the front of the buffer when
+   less than half of it is left free at the end. The buffer starts at
+   size bytes and doubles, up to max bytes, whenever a read fills it. */
+
+struct u_ibuf {
+	uchar *data;
+	size_t start, end;
+	size_t scan; /* where the last search for a line ending stopped */
+	size_t size, max;
+};
+
+extern void u_ibuf_init(u_ibuf*, size_t size, size_t max);
+extern void u_ibuf_free(u_ibuf*);
+
+/* makes room for at least sz bytes, within the limits of max */
+extern void u_ibuf_reserve(u_ibuf*, size_t sz);
+
+/* to allow read() directly into the buffer. u_ibuf_space returns the
+   free space at the end of the buffer, compacting or growing it first
+   if necessary. *avail is 0 if the buffer is full. */
+extern uchar *u_ibuf_space(u_ibuf*, size_t *avail);
+extern void u_ibuf_commit(u_ibuf*, size_t sz);
+
+/* returns the next complete line with its line ending stripped, or NULL
+   if there isn't one yet. The pointer is only valid until the next call
+   to u_ibuf_space */
+extern char *u_ibuf_line(u_ibuf*);
+
+#define u_ibuf_len(IB) ((IB)->end - (IB)->start)
+#define u_ibuf_data(IB) ((IB)->data + (IB)->start)
+
+#endif
@@ -0,0 +1,70 @@
+/* ircd-micro, io.h -- I/O threads
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_IO_H__
+#define __INC_IO_H__
+
+/* Connections accepted by an I/O thread are read from and written to by
+   that thread, on its own eventloop. Everything else, including parsing
+   and all user and channel state, stays on the main thread. The two
+   sides only talk through messages passed on lock-free queues. */
+
+typedef struct u_io_ctx u_io_ctx;
+typedef struct u_io_conn u_io_conn;
+typedef struct u_io_msg u_io_msg;
+
+/* received data is handed over in blocks ending on a line boundary,
+   unless a line gets too long to be held back. off is how much of the
+   block has been consumed */
+struct u_io_msg {
+	u_io_msg *next;
+	int type;
+	u_io_conn *ic;
+	void *ptr;
+	int err;
+	size_t len, off;
+	uchar data[];
+};
+
+/* called on the main thread. input takes ownership of the message, to
+   be released with u_io_msg_free once read. err is 0 for end of stream,
+   which comes after the last input */
+struct u_io_ctx {
+	void (*input)(void *priv, u_io_msg*);
+	void (*error)(void *priv, const char *msg, int err);
+	void (*wrote)(void *priv, size_t sz);
+};
+
+typedef void u_io_accept_cb(u_io_conn*, const struct sockaddr*, socklen_t);
+
+/* returns -1 if the threads could not be started. can only be done once */
+extern int u_io_start(int threads);
+extern int u_io_threads(void);
+
+/* hands a bound, listening, non-blocking socket to the given thread */
+extern void u_io_listen(int thread, int fd, int batch, u_io_accept_cb*);
+
+extern void u_io_attach(u_io_conn*, u_io_ctx*, void *priv);
+extern int u_io_fd(u_io_conn*);
+
+/* moves everything in the sendq over to the connection's thread */
+extern void u_io_write(u_io_conn*, u_sendq*);
+
+/* to be called as input is read, so the thread knows to keep reading */
+extern void u_io_consumed(u_io_conn*, size_t sz);
+
+/* the thread writes out anything still queued and closes the socket. no
+   callbacks are made for the connection after this */
+extern void u_io_close(u_io_conn*);
+
+extern void u_io_msg_free(u_io_msg*);
+
+/* stops the threads where they are, so their sockets can be handed over
+   on upgrade, and lets them carry on if the upgrade fails */
+extern void u_io_pause(void);
+extern void u_io_resume(void);
+
+#endif
@@ -31,6 +31,7 @@
 #include <time.h>
 #include <errno.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include <mowgli.h>
 
@@ -74,8 +75,11 @@ typedef time_t u_ts_t;
 #include "cookie.h"
 #include "crypto.h"
 #include "map.h"
+#include "hash.h"
+#include "ibuf.h"
 #include "strop.h"
 #include "sendq.h"
+#include "io.h"
 #include "upgrade.h"
 #include "version.h"
 #include "vsnf.h"
@@ -31,6 +31,7 @@ enum u_link_type {
 #define U_LINK_SENT_PASS         0x0040
 
 #define IBUFSIZE 2048
+#define IBUFSIZE_SERVER 65536
 
 struct u_link {
 	u_conn *conn;
@@ -46,16 +47,12 @@ struct u_link {
 	} conf;
 	int sendq;
 
-	uchar ibuf[IBUFSIZE+1];
-	size_t ibuflen;
+	/* Lines are removed from ibuf before they are dispatched, so when
+	 * serializing for an upgrade, whatever is left in ibuf is exactly
+	 * what hasn't been executed yet. */
+	u_ibuf ibuf;
 
-	/* This indicates that X bytes should be skipped in ibuf when serializing
-	 * ibuf to do an upgrade. This is necessary to prevent the UPGRADE command
-	 * itself from re-executing after the upgrade.
-	 */
-	size_t ibufskip;
-
-	u_cookie ck_sendto;
+	uint sendto_id; /* for u_sendto dedupe */
 };
 
 extern u_conn_ctx u_link_conn_ctx;
@@ -67,6 +64,13 @@ extern void u_link_fatal(u_link *link, const char *msg);
 
 extern void u_link_vf(u_link *link, const char *fmt, va_list va);
 extern void u_link_f(u_link *link, const char *fmt, ...);
+extern void u_link_put_shared(u_link *link, u_sendq_buf *buf);
+/* raw, already formatted lines, of any length */
+extern void u_link_write(u_link *link, const uchar *data, size_t sz);
+/* for writing lines straight into the sendq, up to SENDQ_CHUNK_MAX at a
+   time. NULL if the sendq is full, and the link has been dealt with */
+extern uchar *u_link_get_buffer(u_link *link, size_t sz);
+extern void u_link_end_buffer(u_link *link, size_t sz);
 
 extern void u_link_vnum(u_link *link, const char *tgt, int num, va_list va);
 extern int u_link_num(u_link *link, int num, ...);
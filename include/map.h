@@ -9,20 +9,29 @@
 
 typedef struct u_map u_map;
 typedef struct u_map_n u_map_n; /* defined internally */
+typedef struct u_map_slot u_map_slot; /* defined internally */
 
 #define MAP_STRING_KEYS 1
+/* pointer keys only. an open addressing hash table instead of an AA
+   tree. lookups are cheaper, but iteration is in no particular order */
+#define MAP_HASHED      2
 
 struct u_map {
 	int iterdepth;
 	uint flags;
 	u_map_n *root;
 	uint size;
+	ulong gen; /* changes whenever nodes are added or removed */
 	mowgli_list_t pending;
+
+	/* MAP_HASHED */
+	u_map_slot *slots;
+	uint cap, used;
 };
 
 typedef void (u_map_cb_t)(u_map*, void *k, void *v, void *priv);
 
-extern u_map *u_map_new(int string_keys);
+extern u_map *u_map_new(int flags);
 extern void u_map_free(u_map*);
 extern void u_map_each(u_map*, u_map_cb_t*, void *priv);
 extern void *u_map_get(u_map*, void *key);
@@ -30,15 +39,60 @@ extern void u_map_set(u_map*, void *key, void *data);
 extern void *u_map_del(u_map*, void *key);
 extern void u_map_dump(u_map*);
 
+typedef struct u_map_pool_stats u_map_pool_stats;
+typedef struct u_map_key_stats u_map_key_stats;
+
+struct u_map_pool_stats {
+	char *name;
+	size_t size;
+	int in_use, num_free;
+	ulong hits, misses; /* misses are slab allocations */
+	size_t mem;
+};
+
+struct u_map_key_stats {
+	uint keys;   /* distinct interned keys */
+	ulong refs;  /* nodes and pending deletes holding them */
+	ulong hits, misses;
+	uint large;  /* keys too long for the pools, malloc'd instead */
+};
+
+/* returns -1 when i is past the last pool */
+extern int u_map_get_pool_stats(int i, u_map_pool_stats*);
+extern void u_map_get_key_stats(u_map_key_stats*);
+
 typedef struct u_map_each_state u_map_each_state;
 
+/* An AA tree with n nodes is at most 2 log2(n+1) levels deep, so this
+   is enough for any map that fits in memory */
+#define U_MAP_MAX_DEPTH 64
+
+/* In-order cursor. It holds no references into the map between calls
+   that it can't recover, so iterations can be nested and the map can be
+   changed in the middle of one. If the map changes, the cursor finds its
+   place again from the last key it returned. Keys come out in order.
+
+   With MAP_STRING_KEYS the cursor holds a reference to the last key
+   until the iteration runs out. An iteration over one of those that is
+   left with break or return must call u_map_each_end, or that key is
+   never freed. For other maps it does nothing.
+
+   For MAP_HASHED maps the cursor is just a slot index. Deleting during
+   an iteration is safe, but an insert that grows the table may cause
+   entries to be skipped or repeated. */
 struct u_map_each_state {
 	u_map *map;
-	mowgli_list_t list;
+	ulong gen;
+	u_map_n *stack[U_MAP_MAX_DEPTH];
+	int depth;
+	bool started;
+	void *key;
+	uint i;
 };
 
 extern void u_map_each_start(u_map_each_state*, u_map*);
 extern bool u_map_each_next(u_map_each_state*, void **k, void **v);
+extern void u_map_each_end(u_map_each_state*);
 
 #define U_MAP_EACH(STATE, MAP, K, V) \
 	for (u_map_each_start((STATE), (MAP)); \
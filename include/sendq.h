@@ -9,22 +9,69 @@
 
 typedef struct u_sendq u_sendq;
 typedef struct u_sendq_chunk u_sendq_chunk;
+typedef struct u_sendq_buf u_sendq_buf;
+
+/* the largest buffer u_sendq_get_buffer will hand out */
+#define SENDQ_CHUNK_MAX 65536
 
 struct u_sendq {
 	size_t size;
 	u_sendq_chunk *head, *tail;
+
+	/* recent send rate, in bytes per second */
+	size_t rate, rate_acc;
+	u_ts_t rate_ts;
+};
+
+/* shared buffers are immutable once queued. a line going to many links
+   can be rendered once and queued on every sendq by reference, instead
+   of being copied into each one */
+struct u_sendq_buf {
+	uint refs;
+	size_t size, alloc;
+	uchar data[];
 };
 
+extern u_sendq_buf *u_sendq_buf_new(size_t sz);
+extern u_sendq_buf *u_sendq_buf_ref(u_sendq_buf*);
+extern void u_sendq_buf_unref(u_sendq_buf*);
+
 extern void u_sendq_init(u_sendq*);
 extern void u_sendq_clear(u_sendq*);
 
-/* TODO: extern void u_sendq_put(u_sendq*, uchar*, size_t); */
+/* copies data of any size into the queue */
+extern size_t u_sendq_put(u_sendq*, const uchar*, size_t);
 
 /* to allow vsnf, sprintf, etc. directly into the send queue */
 extern uchar *u_sendq_get_buffer(u_sendq*, size_t sz);
 extern size_t u_sendq_end_buffer(u_sendq*, size_t sz);
 
+extern size_t u_sendq_put_shared(u_sendq*, u_sendq_buf*);
+
+/* copies up to sz bytes off the front of the queue, returning how many
+   were taken */
+extern size_t u_sendq_take(u_sendq*, uchar *buf, size_t sz);
+
+/* u_sendq_write does a single writev. u_sendq_flush keeps writing until
+   the queue is empty or the socket won't take any more */
 extern int u_sendq_write(u_sendq*, int fd);
+extern int u_sendq_flush(u_sendq*, int fd);
+
+typedef struct u_sendq_pool_stats u_sendq_pool_stats;
+
+struct u_sendq_pool_stats {
+	char *name;
+	size_t chunk_size;
+	int in_use, num_free;
+	ulong hits, misses;
+	size_t mem;
+};
+
+/* returns -1 when i is past the last pool */
+extern int u_sendq_get_pool_stats(int i, u_sendq_pool_stats*);
+extern size_t u_sendq_memory(void);
+
+extern int init_sendq(void);
 
 extern mowgli_json_t *u_sendq_to_json(u_sendq *sq);
 extern int u_sendq_from_json(mowgli_json_t *sjq, u_sendq *sq);
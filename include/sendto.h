@@ -22,6 +22,10 @@
 extern void u_sendto_start(void);
 extern void u_sendto_skip(u_link*);
 
+/* every link holds one of these for as long as it exists */
+extern uint u_sendto_id_new(void);
+extern void u_sendto_id_free(uint);
+
 extern void u_sendto(u_link*, char*, ...);
 
 /* sends message to the various places. these implementations are based
@@ -37,14 +41,21 @@ extern void u_sendto_servers(u_link*, char*, ...);
 extern void u_sendto_list(mowgli_list_t *list, u_link*, char*, ...);
 extern void u_sendto_map(u_map *map, u_link*, char*, ...); /* to values */
 
+/* sends a QUIT for each of the users to every local user that can see
+   them, with all of one recipient's QUITs queued in a single write */
+extern void u_sendto_split(u_user **users, int n, char *reason);
+
 typedef struct u_sendto_state u_sendto_state;
 
 struct u_sendto_state {
-	u_map_each_state chans;
-	u_map_each_state members;
+	u_user *u;
+	int chan_i;
 	u_chan *c;
 	uint type;
 	mowgli_patricia_iteration_state_t pstate;
+
+	u_chan_recips *recips;
+	int i, end;
 };
 
 extern void u_sendto_chan_start(u_sendto_state*, u_chan*, u_link*, uint);
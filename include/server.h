@@ -31,6 +31,7 @@
 #define CAPAB_CLUSTER      0x4000
 
 #define SERVER_IS_BURSTING    0x1
+#define SERVER_IS_SPLITTING   0x2
 
 /* registration postpone */
 #define SERVER_MASK_WAIT        0xff000000
@@ -46,6 +47,7 @@ struct u_server {
 
 	char sid[4]; /* if empty, this server is a TS5 */
 	char name[MAXSERVNAME+1];
+	u_hash_ent name_ent;
 	char desc[MAXSERVDESC+1];
 	uint capab;
 
@@ -59,12 +61,22 @@ struct u_server {
 
 #define IS_SERVER_LOCAL(sv) ((sv)->hops == 1)
 
+/* a line prefix for messages from this server, ":name " or ":sid " */
+typedef struct u_server_prefix {
+	uint len;
+	char s[MAXSERVNAME+3];
+} u_server_prefix;
+
 #define SERVER(sv) ((u_server*)(sv))
 
 extern mowgli_patricia_t *servers_by_sid;
-extern mowgli_patricia_t *servers_by_name;
+extern mowgli_patricia_t *servers_by_name; /* for walking all servers */
+extern u_hash server_index; /* for lookups by name */
 
 extern u_server me;
+/* kept in step with me.name and me.sid */
+extern u_server_prefix me_prefix_user;
+extern u_server_prefix me_prefix_server;
 extern mowgli_list_t my_motd;
 extern mowgli_list_t my_admininfo;
 extern char my_net_name[MAXNETNAME+1];
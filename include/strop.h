@@ -40,4 +40,9 @@ struct u_strop_wrap {
 extern void u_strop_wrap_start(u_strop_wrap*, size_t width);
 extern char *u_strop_wrap_word(u_strop_wrap*, char*);
 
+/* line endings */
+
+/* returns a pointer to the first \r or \n in buf, or NULL */
+extern uchar *u_memeol(const uchar *buf, size_t len);
+
 #endif
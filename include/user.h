@@ -47,10 +47,12 @@ struct u_user {
 	char uid[10];
 
 	uint mode, flags;
-	u_map *channels;
+	struct u_chanuser **channels; /* see u_chanuser */
+	int nchannels, channels_alloc;
 	u_map *invites;
 
 	char nick[MAXNICKLEN+1];
+	u_hash_ent nick_ent;
 	char acct[MAXACCOUNT+1];
 	u_ts_t nickts;
 
@@ -64,6 +66,11 @@ struct u_user {
 
 	char away[MAXAWAY+1];
 
+	/* nick!ident@host, rebuilt by u_user_mask when masklen is 0. Anything
+	   that changes nick, ident or host must call u_user_mask_changed */
+	char mask[MAXNICKLEN+MAXIDENT+MAXHOST+3];
+	ushort masklen;
+
 	u_ratelimit_t limit;
 
 	u_link *link; /* never null, except when shutting down */
@@ -82,7 +89,7 @@ struct u_user {
 #define IS_REGISTERED(u) (!IS_LOCAL_USER(u) || \
                           ((u)->link->flags & U_LINK_REGISTERED) != 0)
 
-extern mowgli_patricia_t *users_by_nick;
+extern u_hash nick_index;
 extern mowgli_patricia_t *users_by_uid;
 
 extern u_mode_info umode_infotab[128];
@@ -107,9 +114,42 @@ static inline u_user *u_user_by_ref(u_link *link, char *ref)
 	        u_user_by_uid(ref) : u_user_by_nick(ref);
 }
 
+static inline void u_user_mask_changed(u_user *u)
+{
+	u->masklen = 0;
+}
+
+static inline char *u_user_mask(u_user *u)
+{
+	char *s;
+	size_t len;
+
+	if (u->masklen)
+		return u->mask;
+
+	s = u->mask;
+	len = strlen(u->nick);
+	memcpy(s, u->nick, len);
+	s += len;
+	*s++ = '!';
+	len = strlen(u->ident);
+	memcpy(s, u->ident, len);
+	s += len;
+	*s++ = '@';
+	len = strlen(u->host);
+	memcpy(s, u->host, len);
+	s += len;
+	*s = '\0';
+
+	u->masklen = s - u->mask;
+	return u->mask;
+}
+
 extern char *u_user_modes(u_user*);
 
 extern void u_user_set_nick(u_user*, char*, uint);
+extern void u_user_set_ident(u_user*, char*);
+extern void u_user_set_host(u_user*, char*);
 
 extern bool u_user_try_override(u_user*);
 
@@ -117,6 +157,8 @@ extern void u_user_vnum(u_user*, int, va_list);
 extern int u_user_num(u_user*, int num, ...);
 
 extern void u_user_send_isupport(u_user*);
+/* drops the cached ISUPPORT and MOTD replies. see user.c */
+extern void u_user_reply_cache_clear(void);
 extern void u_user_send_motd(u_user*);
 
 extern void u_user_welcome(u_user*);
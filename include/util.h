@@ -46,6 +46,9 @@ extern struct sockaddr* u_pton(const char*, struct sockaddr*, socklen_t*);
 
 extern char *cut(char **p, char *delim);
 
+extern char rfc1459_casemap[256];
+extern char ascii_casemap[256];
+
 extern void null_canonize();
 extern void rfc1459_canonize();
 extern void ascii_canonize();
@@ -259,6 +262,7 @@ static inline bool json_ogetb(mowgli_json_t *obj, const char *k)
 }
 
 extern int set_cloexec(int fd);
+extern int set_nonblocking(int fd);
 
 inline static size_t base64_inflate_size(size_t len) {
 	return (((len+2)/3)*4)+1;
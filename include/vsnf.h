@@ -15,6 +15,11 @@
 extern int vsnf(int type, char *buf, uint size, const char *fmt, va_list va);
 extern int snf(int, char*, uint, char*, ...);
 
+/* USER and SERVER formats are compiled and cached by format pointer
+   unless this is false, so they must be string constants. see vsnf.c */
+extern bool vsnf_compiled;
+extern void vsnf_flush(void);
+
 /*
    It's like vsnprintf with IRC-suitable additions. This will a)
    guard against buffer overflow problems, since 4.3 BSD does not have
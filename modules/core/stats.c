@@ -150,6 +150,76 @@ static void stats_modules(u_sourceinfo *si, struct stats_info *info)
 	}
 }
 
+static void stats_sendq(u_sourceinfo *si, struct stats_info *info)
+{
+	u_sendq_pool_stats st;
+	int i;
+
+	for (i=0; u_sendq_get_pool_stats(i, &st) == 0; i++) {
+		notice(si, "%6s %5u bytes: %d used, %d free, %u hits, "
+		       "%u misses, %u bytes", st.name, (uint)st.chunk_size,
+		       st.in_use, st.num_free, (uint)st.hits,
+		       (uint)st.misses, (uint)st.mem);
+	}
+
+	notice(si, "total sendq memory: %u bytes", (uint)u_sendq_memory());
+}
+
+static void stats_map(u_sourceinfo *si, struct stats_info *info)
+{
+	u_map_pool_stats st;
+	u_map_key_stats kst;
+	int i;
+
+	for (i=0; u_map_get_pool_stats(i, &st) == 0; i++) {
+		notice(si, "%6s %3u bytes: %d used, %d free, %u hits, "
+		       "%u misses, %u bytes", st.name, (uint)st.size,
+		       st.in_use, st.num_free, (uint)st.hits,
+		       (uint)st.misses, (uint)st.mem);
+	}
+
+	u_map_get_key_stats(&kst);
+
+	notice(si, "keys: %u interned, %u refs, %u hits, %u misses, "
+	       "%u too long for pools", kst.keys, (uint)kst.refs,
+	       (uint)kst.hits, (uint)kst.misses, kst.large);
+}
+
+static void stats_conn(u_sourceinfo *si, struct stats_info *info)
+{
+	u_conn_stats st;
+
+	u_conn_get_stats(&st);
+
+	notice(si, "poll interest: %u updates requested, %u made, %u saved "
+	       "over %u loop iterations", (uint)st.interest_requests,
+	       (uint)st.interest_changes,
+	       (uint)(st.interest_requests - st.interest_changes),
+	       (uint)st.flushes);
+
+	notice(si, "output: %u lines in %u writes, %u.%02u lines per write, "
+	       "%u peak", (uint)st.output_lines, (uint)st.output_writes,
+	       (uint)(st.output_writes ?
+	         st.output_lines / st.output_writes : 0),
+	       (uint)(st.output_writes ?
+	         st.output_lines * 100 / st.output_writes % 100 : 0),
+	       (uint)st.output_lines_peak);
+
+	if (st.accept_ts != NOW.tv_sec) {
+		st.accepts_last_sec = NOW.tv_sec - st.accept_ts == 1 ?
+			st.accepts_this_sec : 0;
+		st.accepts_this_sec = 0;
+	}
+
+	notice(si, "accepts: %u total, %u this second, %u last second, "
+	       "%u peak", (uint)st.accepts, (uint)st.accepts_this_sec,
+	       (uint)st.accepts_last_sec, (uint)st.accepts_peak_sec);
+
+	notice(si, "cleanup: %u waiting, %u peak, %u done, %d pooled conns",
+	       (uint)st.cleanup_depth, (uint)st.cleanup_peak,
+	       (uint)st.cleanups, st.conn_pool_size);
+}
+
 struct stats_info stats[] = {
 	{ "o", NEED_OPER, stats_o },
 	{ "i", NEED_OPER, stats_i },
@@ -158,6 +228,9 @@ struct stats_info stats[] = {
 	/* extended stats */
 	{ "commands", NEED_OPER, stats_commands },
 	{ "modules",  NEED_OPER, stats_modules  },
+	{ "sendq",    NEED_OPER, stats_sendq    },
+	{ "conn",     NEED_OPER, stats_conn     },
+	{ "map",      NEED_OPER, stats_map      },
 
 	{ }
 };
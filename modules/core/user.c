@@ -15,7 +15,7 @@ static int c_uu_user(u_sourceinfo *si, u_msg *msg)
 	if (!is_valid_ident(buf))
 		return u_link_num(si->source, ERR_GENERIC, "Invalid username");
 
-	u_strlcpy(si->u->ident, buf, MAXIDENT+1);
+	u_user_set_ident(si->u, buf);
 	u_strlcpy(si->u->gecos, msg->argv[3], MAXGECOS+1);
 
 	u_user_try_register(si->u);
@@ -7,6 +7,7 @@
 #include "ircd.h"
 
 mowgli_patricia_t *all_chans;
+u_hash chan_index;
 
 static ulong cmode_get_flag_bits(u_modes *m)
 {
@@ -249,27 +250,34 @@ static u_chan *chan_create_real(const char *name)
 	chan->mode = cmode_default;
 	chan->flags = 0;
 	u_cookie_reset(&chan->ck_flags);
-	chan->members = u_map_new(0);
+	chan->members = NULL;
+	chan->nmembers = chan->members_alloc = 0;
+	chan->member_index = u_map_new(MAP_HASHED);
 	mowgli_list_init(&chan->ban);
 	mowgli_list_init(&chan->quiet);
 	mowgli_list_init(&chan->banex);
 	mowgli_list_init(&chan->invex);
-	chan->invites = u_map_new(0);
+	chan->invites = u_map_new(MAP_HASHED);
 	chan->forward = NULL;
 	chan->key = NULL;
 	chan->limit = -1;
+	chan->nlocal = 0;
+	chan->routes = NULL;
+	chan->nroutes = chan->routes_alloc = 0;
+	chan->recips = NULL;
 
 	if (name[0] == '&')
 		chan->flags |= CHAN_LOCAL;
 
 	mowgli_patricia_add(all_chans, chan->name, chan);
+	u_hash_add(&chan_index, &chan->name_ent, chan->name, chan);
 
 	return chan;
 }
 
 u_chan *u_chan_get(char *name)
 {
-	return mowgli_patricia_retrieve(all_chans, name);
+	return u_hash_get(&chan_index, name);
 }
 
 u_chan *u_chan_create(char *name)
@@ -317,9 +325,9 @@ static void drop_param(char **p)
 
 void u_chan_drop(u_chan *chan)
 {
-	/* TODO: u_map_free callback! */
 	/* TODO: send PART to all users in this channel! */
-	u_map_free(chan->members);
+	free(chan->members);
+	u_map_free(chan->member_index);
 	drop_list(&chan->ban);
 	drop_list(&chan->quiet);
 	drop_list(&chan->banex);
@@ -327,8 +335,11 @@ void u_chan_drop(u_chan *chan)
 	u_clr_invites_chan(chan);
 	drop_param(&chan->forward);
 	drop_param(&chan->key);
+	u_chan_recips_unref(chan->recips);
+	free(chan->routes);
 
 	mowgli_patricia_delete(all_chans, chan->name);
+	u_hash_del(&chan_index, &chan->name_ent);
 	free(chan);
 }
 
@@ -457,13 +468,11 @@ int u_chan_send_topic(u_chan *c, u_user *u)
    *       *****    ***     **  = 11 */
 int u_chan_send_names(u_chan *c, u_user *u)
 {
-	u_map_each_state st;
 	u_strop_wrap wrap;
-	u_user *tu;
 	u_chanuser *cu;
 	mowgli_node_t *n;
 	char *s, pfx;
-	int sz;
+	int sz, i;
 
 	pfx = c->mode & CMODE_PRIVATE ? '*'
 	    : c->mode & CMODE_SECRET ? '@'
@@ -471,7 +480,7 @@ int u_chan_send_names(u_chan *c, u_user *u)
 
 	sz = strlen(me.name) + strlen(u->nick) + strlen(c->name) + 11;
 	u_strop_wrap_start(&wrap, 510 - sz);
-	U_MAP_EACH(&st, c->members, &tu, &cu) {
+	U_CHAN_EACH_MEMBER(c, i, cu) {
 		char *p, nbuf[MAXNICKLEN+3];
 
 		p = nbuf;
@@ -481,7 +490,7 @@ int u_chan_send_names(u_chan *c, u_user *u)
 			    (p == nbuf || u->flags & CAP_MULTI_PREFIX))
 				*p++ = cs->prefix;
 		}
-		strcpy(p, tu->nick);
+		strcpy(p, cu->u->nick);
 
 		while ((s = u_strop_wrap_word(&wrap, nbuf)) != NULL)
 			u_user_num(u, RPL_NAMREPLY, pfx, c, s);
@@ -572,19 +581,196 @@ void u_clr_invites_user(u_user *u)
 	u_map_each(u->invites, (u_map_cb_t*)inv_user_cb, u);
 }
 
+static void recips_invalidate(u_chan *c)
+{
+	u_chan_recips_unref(c->recips);
+	c->recips = NULL;
+}
+
+static u_chan_recips *recips_build(u_chan *c)
+{
+	u_chan_recips *r;
+	u_user *u;
+	u_chanuser *cu;
+	int i;
+
+	r = malloc(sizeof(*r) + (c->nlocal + c->nroutes) * sizeof(u_link*));
+	r->refs = 1;
+	r->nusers = 0;
+
+	/* a channel made up of only remote users, common on hubs, never
+	   needs the member list walked at all */
+	if (c->nlocal > 0) {
+		U_CHAN_EACH_MEMBER(c, i, cu) {
+			u = cu->u;
+			if (u->link == NULL)
+				continue;
+			if (u->link->type == LINK_SERVER)
+				continue;
+			if (r->nusers < c->nlocal)
+				r->links[r->nusers++] = u->link;
+		}
+	}
+
+	for (i=0; i<c->nroutes; i++)
+		r->links[r->nusers + i] = c->routes[i].link;
+	r->nlinks = r->nusers + c->nroutes;
+
+	return r;
+}
+
+u_chan_recips *u_chan_recips_get(u_chan *c)
+{
+	if (c->recips == NULL)
+		c->recips = recips_build(c);
+
+	c->recips->refs++;
+	return c->recips;
+}
+
+void u_chan_recips_unref(u_chan_recips *r)
+{
+	if (r != NULL && --r->refs == 0)
+		free(r);
+}
+
+/* Remote members only change the recipient set when they are the first
+   or last member behind their server link, so netjoins and netsplits
+   elsewhere on the network leave a channel's recipients alone. */
+
+static void route_add(u_chan *c, u_link *link)
+{
+	int i;
+
+	for (i=0; i<c->nroutes; i++) {
+		if (c->routes[i].link == link) {
+			c->routes[i].count++;
+			return;
+		}
+	}
+
+	if (c->nroutes == c->routes_alloc) {
+		c->routes_alloc = c->routes_alloc ? c->routes_alloc * 2 : 2;
+		c->routes = realloc(c->routes,
+		                    c->routes_alloc * sizeof(*c->routes));
+	}
+
+	c->routes[c->nroutes].link = link;
+	c->routes[c->nroutes].count = 1;
+	c->nroutes++;
+
+	recips_invalidate(c);
+}
+
+static void route_del(u_chan *c, u_link *link)
+{
+	int i;
+
+	for (i=0; i<c->nroutes; i++) {
+		if (c->routes[i].link == link)
+			break;
+	}
+
+	if (i == c->nroutes) {
+		u_log(LG_WARN, "%C: no route to remove for a member", c);
+		return;
+	}
+
+	if (--c->routes[i].count > 0)
+		return;
+
+	c->routes[i] = c->routes[--c->nroutes];
+
+	recips_invalidate(c);
+}
+
+static void member_link_add(u_chan *c, u_user *u)
+{
+	if (u->link == NULL)
+		return;
+
+	if (u->link->type == LINK_SERVER) {
+		route_add(c, u->link);
+	} else {
+		c->nlocal++;
+		recips_invalidate(c);
+	}
+}
+
+static void member_link_del(u_chan *c, u_user *u)
+{
+	if (u->link == NULL)
+		return;
+
+	if (u->link->type == LINK_SERVER) {
+		route_del(c, u->link);
+	} else {
+		c->nlocal--;
+		recips_invalidate(c);
+	}
+}
+
+/* pooled chanusers are chained through their c pointer */
+#define CU_POOL_MAX 4096
+
+static u_chanuser *cu_pool = NULL;
+static int cu_pool_size = 0;
+
+static u_chanuser *cu_get(void)
+{
+	u_chanuser *cu;
+
+	if (cu_pool == NULL)
+		return malloc(sizeof(*cu));
+
+	cu = cu_pool;
+	cu_pool = (u_chanuser*)cu->c;
+	cu_pool_size--;
+	return cu;
+}
+
+static void cu_put(u_chanuser *cu)
+{
+	if (cu_pool_size >= CU_POOL_MAX) {
+		free(cu);
+		return;
+	}
+
+	cu->c = (u_chan*)cu_pool;
+	cu_pool = cu;
+	cu_pool_size++;
+}
+
+/* appends cu to a membership array, growing it if needed, and returns
+   its index */
+static int cu_vec_add(u_chanuser ***vec, int *n, int *alloc, u_chanuser *cu)
+{
+	if (*n == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 4;
+		*vec = realloc(*vec, *alloc * sizeof(**vec));
+	}
+
+	(*vec)[*n] = cu;
+	return (*n)++;
+}
+
 /* XXX: assumes the chanuser doesn't already exist */
 u_chanuser *u_chan_user_add(u_chan *c, u_user *u)
 {
 	u_chanuser *cu;
 
-	cu = malloc(sizeof(*cu));
+	cu = cu_get();
 	cu->flags = 0;
 	u_cookie_reset(&cu->ck_flags);
 	cu->c = c;
 	cu->u = u;
 
-	u_map_set(c->members, u, cu);
-	u_map_set(u->channels, c, cu);
+	cu->ci = cu_vec_add(&c->members, &c->nmembers, &c->members_alloc, cu);
+	cu->ui = cu_vec_add(&u->channels, &u->nchannels,
+	                    &u->channels_alloc, cu);
+	u_map_set(c->member_index, u, cu);
+
+	member_link_add(c, u);
 
 	return cu;
 }
@@ -593,13 +779,23 @@ void u_chan_user_del(u_chanuser *cu)
 {
 	u_chan *c = cu->c;
 	u_user *u = cu->u;
+	u_chanuser *last;
+
+	last = c->members[--c->nmembers];
+	c->members[cu->ci] = last;
+	last->ci = cu->ci;
+
+	last = u->channels[--u->nchannels];
+	u->channels[cu->ui] = last;
+	last->ui = cu->ui;
 
-	u_map_del(c->members, u);
-	u_map_del(u->channels, c);
+	u_map_del(c->member_index, u);
 
-	free(cu);
+	member_link_del(c, u);
 
-	if (c->members->size == 0) {
+	cu_put(cu);
+
+	if (c->nmembers == 0) {
 		u_log(LG_DEBUG, "u_chan_user_del: %C empty, dropping...", c);
 		u_chan_drop(c);
 	}
@@ -607,7 +803,7 @@ void u_chan_user_del(u_chanuser *cu)
 
 u_chanuser *u_chan_user_find(u_chan *c, u_user *u)
 {
-	return u_map_get(c->members, u);
+	return u_map_get(c->member_index, u);
 }
 
 typedef struct extban extb_t;
@@ -709,11 +905,9 @@ static int is_in_list(u_chan *c, u_user *u, char *host, mowgli_list_t *list)
 
 int u_entry_blocked(u_chan *c, u_user *u, char *key)
 {
-	char host[BUFSIZE];
+	char *host = u_user_mask(u);
 	int invited = u_has_invite(c, u);
 
-	snf(FMT_USER, host, BUFSIZE, "%H", u);
-
 	if ((c->mode & CMODE_INVITEONLY)) {
 		if (!is_in_list(c, u, host, &c->invex) && !invited)
 			return ERR_INVITEONLYCHAN;
@@ -729,7 +923,7 @@ int u_entry_blocked(u_chan *c, u_user *u, char *key)
 			return ERR_BANNEDFROMCHAN;
 	}
 
-	if (c->limit > 0 && c->members->size >= c->limit && !invited)
+	if (c->limit > 0 && c->nmembers >= c->limit && !invited)
 		return ERR_CHANNELISFULL;
 
 	/* TODO: an invite also allows +j and +r to be bypassed */
@@ -758,10 +952,6 @@ u_chan *u_find_forward(u_chan *c, u_user *u, char *key)
 
 int u_is_muted(u_chanuser *cu)
 {
-	char buf[512];
-
-	snf(FMT_USER, buf, 512, "%H", cu->u);
-
 	if (u_cookie_cmp(&cu->ck_flags, &cu->c->ck_flags) >= 0)
 		return cu->flags & CU_MUTED;
 
@@ -771,7 +961,7 @@ int u_is_muted(u_chanuser *cu)
 	if (cu->flags & (CU_PFX_OP | CU_PFX_VOICE))
 		return 0;
 
-	if (!is_in_list(cu->c, cu->u, buf, &cu->c->quiet)
+	if (!is_in_list(cu->c, cu->u, u_user_mask(cu->u), &cu->c->quiet)
 	    && !(cu->c->mode & CMODE_MODERATED))
 		return 0;
 
@@ -1037,9 +1227,9 @@ static int dump_specific_chan(u_chan *ch, mowgli_json_t *j_chans)
 	jmems = mowgli_json_create_object();
 	json_oseto  (jch, "members",       jmems);
 
-	U_MAP_EACH(&st, ch->members, &u, &cu) {
+	U_CHAN_EACH_MEMBER(ch, i, cu) {
 		jmem = mowgli_json_create_object();
-		json_oseto(jmems, u->uid, jmem);
+		json_oseto(jmems, cu->u->uid, jmem);
 		json_oseti(jmem,  "flags", cu->flags);
 		json_oseto(jmem,  "ck_flags", u_cookie_to_json(&cu->ck_flags));
 	}
@@ -1074,6 +1264,8 @@ int init_chan(void)
 	if (!(all_chans = mowgli_patricia_create(ascii_canonize)))
 		return -1;
 
+	u_hash_init(&chan_index, ascii_casemap);
+
 	u_bitmask_reset(&cmode_flags);
 	for (i=0; i<128; i++) {
 		u_mode_info *info = cmode_infotab + i;
@@ -4,15 +4,44 @@
    This file is protected under the terms contained
    in the COPYING file in the project root */
 
+/* for accept4 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "ircd.h"
 
 /* globals */
 
 static mowgli_list_t awaiting_cleanup;
+static mowgli_list_t pending_input;
+
+/* connections whose poll interest needs to be brought up to date before
+   the poller next runs */
+static mowgli_list_t dirty_conns;
+
+static u_conn_stats stats;
+
+/* Dead connections are torn down at most CLEANUP_BATCH per loop
+   iteration, oldest first, so a mass quit is spread over several
+   iterations instead of stalling one. Until then the fd stays open, so
+   the kernel can't hand the same number to a new connection while the
+   old pollable still refers to it. */
+#define CLEANUP_BATCH 256
+
+/* freed u_conn structs kept around for reuse */
+#define CONN_POOL_MAX 1024
+
+static u_conn *conn_pool = NULL;
+static int conn_pool_size = 0;
+
+/* incremented once per event loop iteration */
+static ulong loop_gen = 1;
 
 /* forward declarations */
 
 static void rdns_start(u_conn*, const struct sockaddr*, socklen_t);
+static void rdns_cancel(u_conn*);
 
 static void connect_end(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                         mowgli_eventloop_io_dir_t dir, void *priv);
@@ -24,18 +53,62 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 
+static u_io_ctx conn_io_ctx;
+
 static void sync_on_update(u_conn *conn);
+static void sync_interest(u_conn *conn);
 
 /* connection creation and shutdown */
 /* -------------------------------- */
 
+static void io_in_clear(u_conn *conn)
+{
+	u_io_msg *m, *next;
+
+	for (m = conn->io_in; m; m = next) {
+		next = m->next;
+		u_io_msg_free(m);
+	}
+
+	conn->io_in = conn->io_in_last = NULL;
+}
+
+/* pooled conns are chained through their priv pointer */
+static u_conn *conn_alloc(void)
+{
+	u_conn *conn;
+
+	if (conn_pool == NULL)
+		return calloc(1, sizeof(u_conn));
+
+	conn = conn_pool;
+	conn_pool = conn->priv;
+	conn_pool_size--;
+
+	memset(conn, 0, sizeof(*conn));
+	return conn;
+}
+
+static void conn_free(u_conn *conn)
+{
+	if (conn_pool_size >= CONN_POOL_MAX) {
+		free(conn);
+		return;
+	}
+
+	conn->priv = conn_pool;
+	conn_pool = conn;
+	conn_pool_size++;
+}
+
 static u_conn *conn_create(mowgli_eventloop_t *ev, u_conn_ctx *ctx,
                            void *priv, int fd,
                            const struct sockaddr *sa, socklen_t salen)
 {
-	u_conn *conn = calloc(1, sizeof(u_conn));
+	u_conn *conn = conn_alloc();
 	conn->state = U_CONN_INVALID;
-	conn->poll = mowgli_pollable_create(ev, fd, conn);
+	if (fd >= 0)
+		conn->poll = mowgli_pollable_create(ev, fd, conn);
 
 	if (! u_ntop((struct sockaddr*) sa, conn->ip)) {
 		/* this is not the best thing to do, but whatever */
@@ -55,23 +128,28 @@ static u_conn *conn_create(mowgli_eventloop_t *ev, u_conn_ctx *ctx,
 
 static void final_cleanup(u_conn *conn)
 {
-	mowgli_eventloop_t *ev = conn->poll->eventloop;
-	int fd = conn->poll->fd;
-
 	if (conn->ctx->cleanup)
 		conn->ctx->cleanup(conn);
 
-	if (conn->dnsq)
-		mowgli_dns_delete_query(base_dns, conn->dnsq);
+	rdns_cancel(conn);
 
 	u_sendq_clear(&conn->sendq);
 
-	mowgli_pollable_destroy(ev, conn->poll);
-	close(fd);
+	if (conn->io != NULL) {
+		/* the thread writes out what it has and closes the socket */
+		io_in_clear(conn);
+		u_io_close(conn->io);
+	} else {
+		int fd = conn->poll->fd;
+
+		mowgli_pollable_destroy(conn->poll->eventloop, conn->poll);
+		close(fd);
+	}
 
 	mowgli_node_delete(&conn->n, &awaiting_cleanup);
+	stats.cleanups++;
 
-	free(conn);
+	conn_free(conn);
 }
 
 static int make_nonblocking(int fd)
@@ -114,6 +192,46 @@ static int start_nonblocking_connect(const struct sockaddr *sa, socklen_t salen)
 	return fd;
 }
 
+/* Accepted sockets are deliberately not close-on-exec, since client
+   connections are handed over to the new process on upgrade. */
+static int accept_nonblocking(int listener, struct sockaddr *sa,
+                              socklen_t *salen)
+{
+	int fd;
+
+#ifdef SOCK_NONBLOCK
+	fd = accept4(listener, sa, salen, SOCK_NONBLOCK);
+#else
+	fd = accept(listener, sa, salen);
+
+	if (fd >= 0 && make_nonblocking(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+#endif
+
+	return fd;
+}
+
+/* one-second buckets, so STATS can show the recent accept rate */
+static void count_accept(void)
+{
+	if (NOW.tv_sec != stats.accept_ts) {
+		if (NOW.tv_sec - stats.accept_ts == 1)
+			stats.accepts_last_sec = stats.accepts_this_sec;
+		else
+			stats.accepts_last_sec = 0;
+		stats.accepts_this_sec = 0;
+		stats.accept_ts = NOW.tv_sec;
+	}
+
+	stats.accepts++;
+	stats.accepts_this_sec++;
+
+	if (stats.accepts_this_sec > stats.accepts_peak_sec)
+		stats.accepts_peak_sec = stats.accepts_this_sec;
+}
+
 u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
                       ulong flags, int listener)
 {
@@ -124,15 +242,23 @@ u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
 	socklen_t addrlen = sizeof(addr);
 	memset(&addr, 0, addrlen);
 
-	if ((fd = accept(listener, (struct sockaddr*) &addr, &addrlen)) < 0) {
+	fd = accept_nonblocking(listener, (struct sockaddr*) &addr, &addrlen);
+
+	if (fd < 0) {
+		int e = errno;
+
+		if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR ||
+		    e == ECONNABORTED) {
+			errno = EAGAIN;
+			return NULL;
+		}
+
 		u_perror("accept");
+		errno = e;
 		return NULL;
 	}
 
-	if (make_nonblocking(fd) < 0) {
-		close(fd);
-		return NULL;
-	}
+	count_accept();
 
 	conn = conn_create(ev, ctx, priv, fd, (const struct sockaddr*) &addr, addrlen);
 	conn->state = U_CONN_ACTIVE;
@@ -143,6 +269,23 @@ u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
 	return conn;
 }
 
+u_conn *u_conn_adopt(u_conn_ctx *ctx, void *priv, u_io_conn *io,
+                     const struct sockaddr *sa, socklen_t salen)
+{
+	u_conn *conn;
+
+	count_accept();
+
+	conn = conn_create(NULL, ctx, priv, -1, sa, salen);
+	conn->io = io;
+	conn->state = U_CONN_ACTIVE;
+
+	u_io_attach(io, &conn_io_ctx, conn);
+	rdns_start(conn, sa, salen);
+
+	return conn;
+}
+
 u_conn *u_conn_connect(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
                        ulong flags, const struct sockaddr *sa, socklen_t salen)
 {
@@ -179,12 +322,27 @@ static void mark_for_cleanup(u_conn *conn)
 
 	conn->state = U_CONN_AWAIT_CLEANUP;
 
+	if (conn->input_pending) {
+		mowgli_node_delete(&conn->input_n, &pending_input);
+		conn->input_pending = false;
+	}
+
+	if (conn->dirty) {
+		mowgli_node_delete(&conn->dirty_n, &dirty_conns);
+		conn->dirty = false;
+	}
+
 	set_recv(conn, NULL);
 	set_send(conn, NULL);
 
-	sync_on_update(conn);
+	/* the link may sit here for a few iterations, and must not hear
+	   back from the resolver in the meantime */
+	rdns_cancel(conn);
 
 	mowgli_node_add(conn, &conn->n, &awaiting_cleanup);
+
+	if (awaiting_cleanup.count > stats.cleanup_peak)
+		stats.cleanup_peak = awaiting_cleanup.count;
 }
 
 static void fatal_error(u_conn *conn, const char *msg, int err)
@@ -268,6 +426,19 @@ static void rdns_start(u_conn *conn, const struct sockaddr *sa, socklen_t alen)
 		conn->ctx->rdns_start(conn);
 }
 
+static void rdns_cancel(u_conn *conn)
+{
+	struct rdns_query *q;
+
+	if (conn->dnsq == NULL)
+		return;
+
+	q = conn->dnsq->ptr;
+	mowgli_dns_delete_query(base_dns, conn->dnsq);
+	conn->dnsq = NULL;
+	free(q);
+}
+
 /* User data transfer API */
 /* ---------------------- */
 
@@ -289,6 +460,41 @@ static inline bool send_permitted(u_conn *conn)
 	return true;
 }
 
+/* reads what an I/O thread has handed over, the same way read would */
+static ssize_t io_recv(u_conn *conn, uchar *data, size_t sz)
+{
+	u_io_msg *m;
+	size_t n, rsz = 0;
+
+	while (rsz < sz && (m = conn->io_in) != NULL) {
+		n = m->len - m->off;
+		if (n > sz - rsz)
+			n = sz - rsz;
+
+		memcpy(data + rsz, m->data + m->off, n);
+		m->off += n;
+		rsz += n;
+
+		if (m->off == m->len) {
+			if ((conn->io_in = m->next) == NULL)
+				conn->io_in_last = NULL;
+			u_io_msg_free(m);
+		}
+	}
+
+	if (rsz > 0) {
+		u_io_consumed(conn->io, rsz);
+		return rsz;
+	}
+
+	if (!conn->io_eof) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return 0;
+}
+
 ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 {
 	ssize_t rsz;
@@ -296,11 +502,19 @@ ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 	if (!recv_permitted(conn))
 		return 0;
 
-	rsz = read(conn->poll->fd, data, sz);
+	if (conn->io != NULL)
+		rsz = io_recv(conn, data, sz);
+	else
+		rsz = read(conn->poll->fd, data, sz);
 
 	if (rsz < 0) {
 		int e = errno;
 
+		if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR) {
+			errno = EAGAIN;
+			return -1;
+		}
+
 		/* TODO: determine if error is recoverable */
 		u_perror("read");
 
@@ -316,14 +530,37 @@ ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 	return rsz;
 }
 
+/* Write-through send. If nothing is queued, as much as possible is sent
+   immediately and only the remainder is queued, so callers can send
+   payloads of any size without going through the chunk buffers. */
 ssize_t u_conn_send(u_conn *conn, const uchar *data, size_t sz)
 {
+	ssize_t wsz = 0;
+
 	if (!send_permitted(conn))
 		return 0;
 
-	/* TODO */
+	if (conn->state == U_CONN_ACTIVE && conn->sendq.size == 0 &&
+	    conn->io == NULL) {
+		conn->write_gen = loop_gen;
 
-	return 0;
+		wsz = send(conn->poll->fd, data, sz, 0);
+
+		if (wsz < 0) {
+			int e = errno;
+
+			if (e != EAGAIN && e != EWOULDBLOCK && e != EINTR) {
+				u_perror("send");
+				fatal_error(conn, "Write error", e);
+				return -1;
+			}
+
+			wsz = 0;
+		}
+	}
+
+	if (wsz < sz)
+		u_sendq_put(&conn->sendq, data + wsz, sz - wsz);
 
 	sync_on_update(conn);
 
@@ -338,6 +575,19 @@ uchar *u_conn_get_send_buffer(u_conn *conn, size_t sz)
 size_t u_conn_end_send_buffer(u_conn *conn, size_t sz)
 {
 	sz = u_sendq_end_buffer(&conn->sendq, sz);
+	conn->out_lines++;
+
+	sync_on_update(conn);
+
+	return sz;
+}
+
+size_t u_conn_put_shared(u_conn *conn, u_sendq_buf *buf)
+{
+	size_t sz;
+
+	sz = u_sendq_put_shared(&conn->sendq, buf);
+	conn->out_lines++;
 
 	sync_on_update(conn);
 
@@ -349,6 +599,102 @@ void u_conn_sendq_clear(u_conn *conn)
 	u_sendq_clear(&conn->sendq);
 }
 
+size_t u_conn_queued(u_conn *conn)
+{
+	return conn->sendq.size + conn->io_queued;
+}
+
+void u_conn_resume_input(u_conn *conn)
+{
+	if (conn->input_pending || !recv_permitted(conn))
+		return;
+
+	conn->input_pending = true;
+	mowgli_node_add(conn, &conn->input_n, &pending_input);
+}
+
+/* A socket left with unread data calls again, but input from an I/O
+   thread doesn't, so what's left over waits its turn the same way as
+   lines left undispatched. One already waiting for its turn is left to
+   it rather than being let in early. */
+static void call_data_ready(u_conn *conn)
+{
+	if (conn->input_pending || !recv_permitted(conn) ||
+	    conn->ctx->data_ready == NULL)
+		return;
+
+	conn->ctx->data_ready(conn);
+
+	if (conn->io_in != NULL)
+		u_conn_resume_input(conn);
+}
+
+/* Only the connections that were waiting when this starts get a turn.
+   Each is taken off the list before its callback runs, so one that asks
+   to be resumed again goes to the back of the line for the next
+   iteration rather than starving everyone else in this one. */
+static void run_pending_input(void)
+{
+	mowgli_node_t *n;
+	int left = pending_input.count;
+
+	while (left-- > 0 && (n = pending_input.head) != NULL) {
+		u_conn *conn = n->data;
+
+		mowgli_node_delete(n, &pending_input);
+		conn->input_pending = false;
+
+		call_data_ready(conn);
+	}
+}
+
+/* I/O thread callbacks */
+/* -------------------- */
+
+static void io_input(void *priv, u_io_msg *m)
+{
+	u_conn *conn = priv;
+
+	if (conn->io_in_last != NULL)
+		conn->io_in_last->next = m;
+	else
+		conn->io_in = m;
+	conn->io_in_last = m;
+	m->next = NULL;
+
+	call_data_ready(conn);
+}
+
+static void io_error(void *priv, const char *msg, int err)
+{
+	u_conn *conn = priv;
+
+	if (err != 0) {
+		u_log(LG_ERROR, "%s: %s", msg, strerror(err));
+		fatal_error(conn, msg, err);
+		return;
+	}
+
+	/* end of stream, which io_recv reports once the input before it
+	   has been read */
+	conn->io_eof = true;
+
+	call_data_ready(conn);
+}
+
+static void io_wrote(void *priv, size_t sz)
+{
+	u_conn *conn = priv;
+
+	conn->io_queued -= sz;
+}
+
+static u_io_ctx conn_io_ctx = {
+	.input = io_input,
+	.error = io_error,
+	.wrote = io_wrote,
+};
+
 /* mowgli eventloop callbacks */
 /* -------------------------- */
 
@@ -412,7 +758,9 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 
 	sync_time();
 
-	sz = u_sendq_write(&conn->sendq, conn->poll->fd);
+	conn->write_gen = loop_gen;
+
+	sz = u_sendq_flush(&conn->sendq, conn->poll->fd);
 
 	if (sz < 0) {
 		int e = errno;
@@ -427,37 +775,74 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 	sync_on_update(conn);
 }
 
+/* The poller is only told about changes, so setting the same callback
+   twice costs nothing. */
 static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->poll == NULL || conn->poll->read_function == cb)
+		return;
+
+	stats.interest_changes++;
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_READ, cb);
 }
 
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->poll == NULL || conn->poll->write_function == cb)
+		return;
+
+	stats.interest_changes++;
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_WRITE, cb);
 }
 
+/* Called whenever something about the connection that affects its poll
+   interest may have changed. State changes happen right away, but the
+   interest itself is only recorded as dirty and brought up to date once
+   per loop iteration by flush_output, after the queued output has been
+   written, so a connection that gets a hundred lines in one iteration
+   costs at most one write and one update instead of a hundred. */
 static void sync_on_update(u_conn *conn)
 {
-	bool use_recv = false;
+	stats.interest_requests++;
 
 	switch (conn->state) {
-	case U_CONN_ACTIVE:
-		use_recv = true;
-		set_send(conn, conn->sendq.size > 0 ? send_ready : NULL);
-		break;
-
 	case U_CONN_SHUTTING_DOWN:
 		if (conn->sendq.size == 0) {
-			set_send(conn, NULL);
 			mark_for_cleanup(conn);
+			return;
 		}
 		break;
 
+	case U_CONN_INVALID:
+	case U_CONN_AWAIT_CLEANUP:
+		return;
+
+	default:
+		break;
+	}
+
+	if (conn->dirty)
+		return;
+
+	conn->dirty = true;
+	mowgli_node_add(conn, &conn->dirty_n, &dirty_conns);
+}
+
+static void sync_interest(u_conn *conn)
+{
+	bool use_recv = false;
+
+	switch (conn->state) {
+	case U_CONN_ACTIVE:
+		use_recv = true;
+		set_send(conn, conn->sendq.size > 0 ? send_ready : NULL);
+		break;
+
 	case U_CONN_INVALID:
 	case U_CONN_CONNECTING:
+	case U_CONN_SHUTTING_DOWN:
 	case U_CONN_AWAIT_CLEANUP:
 	default:
 		break;
@@ -466,26 +851,108 @@ static void sync_on_update(u_conn *conn)
 	set_recv(conn, use_recv ? recv_ready : NULL);
 }
 
+static void count_output(u_conn *conn)
+{
+	stats.output_writes++;
+	stats.output_lines += conn->out_lines;
+	if (conn->out_lines > stats.output_lines_peak)
+		stats.output_lines_peak = conn->out_lines;
+	conn->out_lines = 0;
+}
+
+/* Output is not written as it is queued. Every line queued for a
+   connection during a loop iteration is written with one writev here,
+   once the iteration is done, so a burst of modes, kicks or joins costs
+   one syscall per recipient instead of one per line. Poll interest is
+   updated afterwards, so only connections whose socket wouldn't take
+   everything end up waiting for writability. Connections that were
+   already written to by send_ready or u_conn_send this iteration are
+   left to the poller. Connections on an I/O thread have their output
+   handed over in one piece instead, including while shutting down, and
+   are done with here once it has all gone. */
+static void flush_output(void)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, dirty_conns.head) {
+		u_conn *conn = n->data;
+
+		mowgli_node_delete(n, &dirty_conns);
+		conn->dirty = false;
+
+		if (conn->io != NULL && conn->sendq.size > 0 &&
+		    (conn->state == U_CONN_ACTIVE ||
+		     conn->state == U_CONN_SHUTTING_DOWN)) {
+			count_output(conn);
+
+			conn->io_queued += conn->sendq.size;
+			u_io_write(conn->io, &conn->sendq);
+
+			if (conn->state == U_CONN_SHUTTING_DOWN)
+				mark_for_cleanup(conn);
+		}
+
+		if (conn->state == U_CONN_ACTIVE && conn->sendq.size > 0 &&
+		    conn->write_gen != loop_gen) {
+			conn->write_gen = loop_gen;
+
+			count_output(conn);
+
+			/* errors are left for send_ready to find */
+			u_sendq_flush(&conn->sendq, conn->poll->fd);
+		}
+
+		sync_interest(conn);
+	}
+
+	stats.flushes++;
+}
+
+void u_conn_get_stats(u_conn_stats *st)
+{
+	memcpy(st, &stats, sizeof(*st));
+
+	st->cleanup_depth = awaiting_cleanup.count;
+	st->conn_pool_size = conn_pool_size;
+}
+
+static void run_cleanup(void)
+{
+	mowgli_node_t *n;
+	int left = CLEANUP_BATCH;
+
+	while (left-- > 0 && (n = awaiting_cleanup.head) != NULL)
+		final_cleanup(n->data);
+}
+
 /* main() API */
 /* ---------- */
 
 void u_conn_run(mowgli_eventloop_t *ev)
 {
-	mowgli_node_t *n, *tn;
-
 	while (!ev->death_requested) {
-		mowgli_eventloop_run_once(ev);
+		/* the end of the previous iteration */
+		flush_output();
+		loop_gen++;
 
-		MOWGLI_LIST_FOREACH_SAFE(n, tn, awaiting_cleanup.head) {
-			u_conn *conn = n->data;
-			final_cleanup(conn);
-		}
+		/* don't sleep in the poller if there is work left over */
+		if (pending_input.count > 0 || awaiting_cleanup.count > 0)
+			mowgli_eventloop_timeout_once(ev, 0);
+		else
+			mowgli_eventloop_run_once(ev);
+
+		sync_time();
+		run_pending_input();
+
+		run_cleanup();
 	}
 }
 
 int init_conn(void)
 {
 	mowgli_list_init(&awaiting_cleanup);
+	mowgli_list_init(&pending_input);
+	mowgli_list_init(&dirty_conns);
 
 	return 0;
 }
@@ -493,12 +960,12 @@ int init_conn(void)
 /* Serialization
  * -------------
  */
-static mowgli_json_t *_pollable_to_json(mowgli_eventloop_pollable_t *poll)
+static mowgli_json_t *_pollable_to_json(int fd)
 {
 	mowgli_json_t *jp;
 
 	jp = mowgli_json_create_object();
-	json_oseti(jp, "fd", poll->fd);
+	json_oseti(jp, "fd", fd);
 
 	return jp;
 }
@@ -522,10 +989,14 @@ static mowgli_eventloop_pollable_t *_pollable_from_json(
 mowgli_json_t *u_conn_to_json(u_conn *conn)
 {
 	mowgli_json_t *jc;
+	int fd;
+
+	/* the upgraded server reads and writes the socket itself */
+	fd = conn->io != NULL ? u_io_fd(conn->io) : conn->poll->fd;
 
 	jc = mowgli_json_create_object();
 	json_oseti  (jc, "state", conn->state);
-	json_oseto  (jc, "poll",  _pollable_to_json(conn->poll));
+	json_oseto  (jc, "poll",  _pollable_to_json(fd));
 	json_osets  (jc, "ip",    conn->ip);
 	json_osets  (jc, "host",  conn->host);
 	json_oseto  (jc, "sendq", u_sendq_to_json(&conn->sendq));
@@ -549,7 +1020,7 @@ u_conn *u_conn_from_json(
 	mowgli_json_t *jpoll, *jsq;
 	mowgli_string_t *jsip, *jshost;
 
-	conn = calloc(1, sizeof(*conn));
+	conn = conn_alloc();
 	u_sendq_init(&conn->sendq);
 
 	if (json_ogetu(jc, "state", &conn->state) < 0)
@@ -610,7 +1081,7 @@ error:
 		close(fd);
 		/* Closing fds means this function fails non-idempotently. */
 	}
-	free(conn);
+	conn_free(conn);
 	return NULL;
 }
 
@@ -0,0 +1,125 @@
+/* ircd-micro, hash.c -- casemapped name index
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Chained hash table over names, with hashing and comparison both done
+   through a casemap, so "Nick" and "nICK" land on the same entry without
+   either being canonized into a copy first. A lookup hashes the name
+   once and then usually compares against a single entry whose cached
+   hash matches, where a patricia retrieve canonizes the name and then
+   walks the trie byte by byte. The table doubles whenever it holds more
+   entries than buckets. */
+
+#include "ircd.h"
+
+#define HASH_MIN_SIZE 256
+
+static uint hash_name(char *map, const char *s)
+{
+	uint h = 2166136261u; /* FNV-1a */
+
+	for (; *s; s++)
+		h = (h ^ (uchar)map[(uchar)*s]) * 16777619u;
+
+	return h;
+}
+
+static bool name_eq(char *map, const char *s1, const char *s2)
+{
+	for (; *s1 && *s2; s1++, s2++) {
+		if (map[(uchar)*s1] != map[(uchar)*s2])
+			return false;
+	}
+
+	return *s1 == *s2;
+}
+
+static void grow(u_hash *h)
+{
+	u_hash_ent **old = h->buckets, *e, *next;
+	uint i, old_size = h->size;
+
+	h->size = old_size ? old_size * 2 : HASH_MIN_SIZE;
+	h->buckets = calloc(h->size, sizeof(*h->buckets));
+
+	for (i=0; i<old_size; i++) {
+		for (e=old[i]; e; e=next) {
+			next = e->next;
+			e->next = h->buckets[e->hash & (h->size - 1)];
+			h->buckets[e->hash & (h->size - 1)] = e;
+		}
+	}
+
+	free(old);
+}
+
+void u_hash_init(u_hash *h, char *casemap)
+{
+	h->casemap = casemap;
+	h->buckets = NULL;
+	h->size = h->count = 0;
+}
+
+static u_hash_ent *find(u_hash *h, const char *key, uint hash)
+{
+	u_hash_ent *e;
+
+	if (h->buckets == NULL)
+		return NULL;
+
+	for (e=h->buckets[hash & (h->size - 1)]; e; e=e->next) {
+		if (e->hash == hash && name_eq(h->casemap, e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+bool u_hash_add(u_hash *h, u_hash_ent *ent, char *key, void *data)
+{
+	u_hash_ent **bucket;
+	uint hash = hash_name(h->casemap, key);
+
+	if (find(h, key, hash) != NULL)
+		return false;
+
+	if (h->count >= h->size)
+		grow(h);
+
+	ent->hash = hash;
+	ent->key = key;
+	ent->data = data;
+
+	bucket = &h->buckets[hash & (h->size - 1)];
+	ent->next = *bucket;
+	*bucket = ent;
+	h->count++;
+
+	return true;
+}
+
+/* does nothing if ent isn't in the table */
+void u_hash_del(u_hash *h, u_hash_ent *ent)
+{
+	u_hash_ent **p;
+
+	if (h->buckets == NULL)
+		return;
+
+	for (p=&h->buckets[ent->hash & (h->size - 1)]; *p; p=&(*p)->next) {
+		if (*p == ent) {
+			*p = ent->next;
+			ent->next = NULL;
+			h->count--;
+			return;
+		}
+	}
+}
+
+void *u_hash_get(u_hash *h, const char *key)
+{
+	u_hash_ent *e = find(h, key, hash_name(h->casemap, key));
+	return e == NULL ? NULL : e->data;
+}
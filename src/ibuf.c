@@ -0,0 +1,114 @@
+/* ircd-micro, ibuf.c -- line input buffers
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+void u_ibuf_init(u_ibuf *ib, size_t size, size_t max)
+{
+	ib->size = size;
+	ib->max = max < size ? size : max;
+	ib->start = ib->end = ib->scan = 0;
+
+	/* +1 so a line at the very end can always be terminated */
+	ib->data = malloc(ib->size + 1);
+}
+
+void u_ibuf_free(u_ibuf *ib)
+{
+	free(ib->data);
+	ib->data = NULL;
+	ib->size = ib->start = ib->end = ib->scan = 0;
+}
+
+static void compact(u_ibuf *ib)
+{
+	if (ib->start == 0)
+		return;
+
+	memmove(ib->data, ib->data + ib->start, ib->end - ib->start);
+	ib->end -= ib->start;
+	ib->scan = ib->scan > ib->start ? ib->scan - ib->start : 0;
+	ib->start = 0;
+}
+
+void u_ibuf_reserve(u_ibuf *ib, size_t sz)
+{
+	size_t size;
+
+	if (ib->size - ib->end >= sz)
+		return;
+
+	compact(ib);
+
+	if (ib->size - ib->end >= sz || ib->size >= ib->max)
+		return;
+
+	for (size = ib->size; size - ib->end < sz && size < ib->max; )
+		size *= 2;
+	if (size > ib->max)
+		size = ib->max;
+
+	u_log(LG_DEBUG, "ibuf: growing %u -> %u", ib->size, size);
+
+	ib->data = realloc(ib->data, size + 1);
+	ib->size = size;
+}
+
+uchar *u_ibuf_space(u_ibuf *ib, size_t *avail)
+{
+	/* moving a partial line down is much cheaper than the extra
+	   read a short tail would cost */
+	if (ib->start > 0 && ib->size - ib->end < ib->size / 2)
+		compact(ib);
+	if (ib->end == ib->size)
+		u_ibuf_reserve(ib, ib->size);
+
+	*avail = ib->size - ib->end;
+	return ib->data + ib->end;
+}
+
+void u_ibuf_commit(u_ibuf *ib, size_t sz)
+{
+	ib->end += sz;
+	if (ib->end > ib->size)
+		ib->end = ib->size;
+
+	/* a read that filled the buffer means more is probably waiting */
+	if (ib->end == ib->size && ib->size < ib->max)
+		u_ibuf_reserve(ib, ib->size);
+}
+
+char *u_ibuf_line(u_ibuf *ib)
+{
+	uchar *s, *p, *e;
+
+	s = ib->data + ib->start;
+	e = ib->data + ib->end;
+
+	/* skip the \n of a \r\n that was split across reads */
+	while (s < e && (*s == '\r' || *s == '\n'))
+		s++;
+	ib->start = s - ib->data;
+
+	/* bytes before scan are already known not to contain a line ending */
+	p = ib->data + (ib->scan > ib->start ? ib->scan : ib->start);
+
+	if ((p = u_memeol(p, e - p)) == NULL) {
+		ib->scan = ib->end;
+		return NULL;
+	}
+
+	/* delete all contiguous line endings at p */
+	while (p < e && (*p == '\r' || *p == '\n'))
+		*p++ = '\0';
+	/* p now points at the start of the next line */
+
+	ib->start = ib->scan = p - ib->data;
+	if (ib->start == ib->end)
+		ib->start = ib->end = ib->scan = 0;
+
+	return (char*)s;
+}
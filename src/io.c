@@ -0,0 +1,828 @@
+/* ircd-micro, io.c -- I/O threads
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* for accept4 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ircd.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* Each thread runs its own mowgli eventloop, with its own listeners and
+   the connections they accepted. It reads, cuts the input into blocks of
+   whole lines for the main thread, and writes out whatever the main
+   thread hands back. The only mowgli calls made on a thread are on its
+   own eventloop and pollables, and nothing on a thread touches the log,
+   the sendq pools or anything else the main thread owns.
+
+   There is one queue per consumer: the main thread's, which every thread
+   pushes onto, and one per thread, which only the main thread pushes
+   onto. A consumer sleeping in its eventloop is woken through a pipe,
+   which is only written to when the queue goes from idle to busy. */
+
+enum {
+	/* to the main thread */
+	IO_ACCEPT,
+	IO_INPUT,
+	IO_ERROR,
+	IO_WROTE,
+	IO_RELEASED,
+
+	/* to a thread */
+	IO_LISTEN,
+	IO_OUTPUT,
+	IO_CLOSE,
+	IO_RESUME,
+	IO_PAUSE,
+};
+
+/* how much a thread reads at once, and from one connection per wakeup */
+#define IO_READ_SIZE   16384
+#define IO_READ_BUDGET 65536
+
+/* a partial line longer than this is handed over anyway, and the link's
+   own buffer sorts it out */
+#define IO_TAIL_MAX    1024
+
+/* how much input may be waiting on the main thread before the thread
+   stops reading from the socket, standing in for the backpressure the
+   socket buffer gives a link that reads for itself */
+#define IO_INPUT_MAX   262144
+
+#define IO_IOVECS      64
+
+#define IO_THROTTLED   0x0001 /* waiting for input to be consumed */
+#define IO_EOF         0x0002 /* the peer is done sending */
+#define IO_DEAD        0x0004 /* an error was reported */
+#define IO_CLOSING     0x0008 /* let go of by the main thread */
+
+typedef struct io_queue io_queue;
+typedef struct io_thread io_thread;
+typedef struct io_listener io_listener;
+
+struct io_queue {
+	u_io_msg *head; /* most recently pushed */
+	u_io_msg *tail; /* next to be popped */
+	u_io_msg *stub;
+	int signalled;
+	int wake[2];
+};
+
+struct io_thread {
+	pthread_t thread;
+	mowgli_eventloop_t *ev;
+	io_queue q;
+	mowgli_eventloop_pollable_t *wake;
+
+	/* every connection on the thread, for u_io_pause */
+	u_io_conn *conns;
+
+	uchar rbuf[IO_READ_SIZE];
+};
+
+struct io_listener {
+	io_thread *t;
+	int fd, batch;
+	u_io_accept_cb *cb;
+	mowgli_eventloop_pollable_t *poll;
+};
+
+struct u_io_conn {
+	/* set before the main thread hears of the connection */
+	io_thread *t;
+	int fd;
+
+	/* thread side */
+	mowgli_eventloop_pollable_t *poll;
+	uint flags;
+	u_io_conn *prev, *next;
+	u_io_msg *out, *out_last;
+	size_t tail_len;
+	uchar tail[IO_TAIL_MAX];
+
+	/* handed over and not yet consumed, changed by both sides */
+	size_t in_flight;
+
+	/* main thread side */
+	u_io_ctx *ctx;
+	void *priv;
+};
+
+static io_thread *threads = NULL;
+static int num_threads = 0;
+
+static io_queue main_q;
+static mowgli_eventloop_pollable_t *main_wake;
+
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static bool pausing = false;
+static int num_paused = 0;
+
+/* messages and queues */
+/* ------------------- */
+
+static u_io_msg *msg_new(int type, u_io_conn *ic, size_t sz)
+{
+	u_io_msg *m = malloc(sizeof(*m) + sz);
+
+	m->next = NULL;
+	m->type = type;
+	m->ic = ic;
+	m->ptr = NULL;
+	m->err = 0;
+	m->len = sz;
+	m->off = 0;
+
+	return m;
+}
+
+void u_io_msg_free(u_io_msg *m)
+{
+	free(m);
+}
+
+static int queue_init(io_queue *q)
+{
+	if (pipe(q->wake) < 0)
+		return -1;
+
+	set_nonblocking(q->wake[0]);
+	set_nonblocking(q->wake[1]);
+	set_cloexec(q->wake[0]);
+	set_cloexec(q->wake[1]);
+
+	q->stub = msg_new(-1, NULL, 0);
+	q->head = q->tail = q->stub;
+	q->signalled = 0;
+
+	return 0;
+}
+
+static void queue_link(io_queue *q, u_io_msg *m)
+{
+	u_io_msg *prev;
+
+	m->next = NULL;
+	prev = __atomic_exchange_n(&q->head, m, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, m, __ATOMIC_SEQ_CST);
+}
+
+/* any number of threads may push at once */
+static void queue_push(io_queue *q, u_io_msg *m)
+{
+	queue_link(q, m);
+
+	if (__atomic_exchange_n(&q->signalled, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(q->wake[1], "", 1) < 0) {
+		/* a full pipe will wake the consumer anyway */
+	}
+}
+
+/* Only ever called by the queue's one consumer. Returns NULL when the
+   queue is empty, and also when a push is halfway done, in which case
+   the pusher's wakeup is still to come. */
+static u_io_msg *queue_pop(io_queue *q)
+{
+	u_io_msg *tail = q->tail;
+	u_io_msg *next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+	if (tail == q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_SEQ_CST))
+		return NULL;
+
+	/* the last message can only be taken off once something is
+	   behind it */
+	queue_link(q, q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+/* must be called before the queue is drained, so a push that comes in
+   while draining wakes the consumer up again */
+static void queue_woken(io_queue *q)
+{
+	char buf[64];
+
+	while (read(q->wake[0], buf, sizeof(buf)) > 0)
+		continue;
+
+	__atomic_store_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+static void to_main(int type, u_io_conn *ic, int err, void *ptr)
+{
+	u_io_msg *m = msg_new(type, ic, 0);
+
+	m->err = err;
+	m->ptr = ptr;
+
+	queue_push(&main_q, m);
+}
+
+/* thread side */
+/* ----------- */
+
+static void conn_read(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                      mowgli_eventloop_io_dir_t dir, void *priv);
+static void conn_write(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                       mowgli_eventloop_io_dir_t dir, void *priv);
+
+static void set_read(u_io_conn *ic, mowgli_eventloop_io_cb_t *cb)
+{
+	if (ic->poll->read_function == cb)
+		return;
+
+	mowgli_pollable_setselect(ic->t->ev, ic->poll,
+	                          MOWGLI_EVENTLOOP_IO_READ, cb);
+}
+
+static void set_write(u_io_conn *ic, mowgli_eventloop_io_cb_t *cb)
+{
+	if (ic->poll->write_function == cb)
+		return;
+
+	mowgli_pollable_setselect(ic->t->ev, ic->poll,
+	                          MOWGLI_EVENTLOOP_IO_WRITE, cb);
+}
+
+static void out_clear(u_io_conn *ic)
+{
+	u_io_msg *m, *next;
+
+	for (m = ic->out; m; m = next) {
+		next = m->next;
+		free(m);
+	}
+
+	ic->out = ic->out_last = NULL;
+}
+
+/* The main thread frees the connection once it hears about this, so
+   nothing may touch it afterwards. */
+static void conn_release(u_io_conn *ic)
+{
+	io_thread *t = ic->t;
+
+	out_clear(ic);
+
+	mowgli_pollable_destroy(t->ev, ic->poll);
+	close(ic->fd);
+
+	if (ic->prev != NULL)
+		ic->prev->next = ic->next;
+	else
+		t->conns = ic->next;
+	if (ic->next != NULL)
+		ic->next->prev = ic->prev;
+
+	to_main(IO_RELEASED, ic, 0, NULL);
+}
+
+/* stops all I/O on the connection and tells the main thread why, unless
+   it has let go of the connection already */
+static void conn_fail(u_io_conn *ic, const char *msg, int err)
+{
+	if (ic->flags & IO_CLOSING) {
+		conn_release(ic);
+		return;
+	}
+
+	ic->flags |= IO_DEAD;
+
+	set_read(ic, NULL);
+	set_write(ic, NULL);
+	out_clear(ic);
+
+	to_main(IO_ERROR, ic, err, (void*) msg);
+}
+
+/* returns how much input is now waiting on the main thread */
+static size_t conn_input(u_io_conn *ic, uchar *data, size_t sz)
+{
+	u_io_msg *m = msg_new(IO_INPUT, ic, sz);
+	size_t waiting;
+
+	memcpy(m->data, data, sz);
+
+	/* counted before the main thread can see it, so it's never
+	   consumed before it's counted */
+	waiting = __atomic_add_fetch(&ic->in_flight, sz, __ATOMIC_SEQ_CST);
+	queue_push(&main_q, m);
+
+	return waiting;
+}
+
+static void conn_read(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                      mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	u_io_conn *ic = priv;
+	uchar *buf = ic->t->rbuf;
+	size_t want, len, n, total = 0;
+	ssize_t sz;
+
+	while (total < IO_READ_BUDGET) {
+		memcpy(buf, ic->tail, ic->tail_len);
+		want = IO_READ_SIZE - ic->tail_len;
+
+		sz = read(ic->fd, buf + ic->tail_len, want);
+
+		if (sz < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			conn_fail(ic, "Read error", errno);
+			return;
+		}
+
+		if (sz == 0) {
+			if (ic->tail_len > 0)
+				conn_input(ic, buf, ic->tail_len);
+			ic->tail_len = 0;
+
+			/* output can still be written */
+			ic->flags |= IO_EOF;
+			set_read(ic, NULL);
+			to_main(IO_ERROR, ic, 0, NULL);
+			return;
+		}
+
+		total += sz;
+		len = ic->tail_len + sz;
+
+		/* everything up to the last line ending goes over */
+		for (n = len; n > 0 && buf[n - 1] != '\n'; n--)
+			continue;
+		if (len - n > IO_TAIL_MAX)
+			n = len;
+
+		ic->tail_len = len - n;
+		memcpy(ic->tail, buf + n, ic->tail_len);
+
+		if (n > 0 && conn_input(ic, buf, n) >= IO_INPUT_MAX) {
+			ic->flags |= IO_THROTTLED;
+			set_read(ic, NULL);
+			return;
+		}
+
+		/* a short read means there is nothing more waiting */
+		if ((size_t) sz < want)
+			return;
+	}
+}
+
+static void conn_flush(u_io_conn *ic)
+{
+	struct iovec iov[IO_IOVECS];
+	u_io_msg *m;
+	size_t offered, left, written = 0;
+	ssize_t sz;
+	int n;
+
+	while (ic->out != NULL) {
+		offered = 0;
+
+		for (n = 0, m = ic->out; n < IO_IOVECS && m; n++, m = m->next) {
+			iov[n].iov_base = m->data + m->off;
+			iov[n].iov_len = m->len - m->off;
+			offered += iov[n].iov_len;
+		}
+
+		sz = writev(ic->fd, iov, n);
+
+		if (sz < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+
+			conn_fail(ic, "Write error", errno);
+			return;
+		}
+
+		written += sz;
+		left = sz;
+
+		while ((m = ic->out) != NULL && left >= m->len - m->off) {
+			left -= m->len - m->off;
+			ic->out = m->next;
+			free(m);
+		}
+		if (m != NULL)
+			m->off += left;
+		else
+			ic->out_last = NULL;
+
+		/* a short write means the socket buffer is full */
+		if ((size_t) sz < offered)
+			break;
+	}
+
+	if (ic->flags & IO_CLOSING) {
+		if (ic->out == NULL)
+			conn_release(ic);
+		return;
+	}
+
+	if (written > 0) {
+		m = msg_new(IO_WROTE, ic, 0);
+		m->len = written;
+		queue_push(&main_q, m);
+	}
+
+	set_write(ic, ic->out != NULL ? conn_write : NULL);
+}
+
+static void conn_write(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                       mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	conn_flush(priv);
+}
+
+static int accept_nonblocking(int listener, struct sockaddr *sa,
+                              socklen_t *salen)
+{
+	int fd;
+
+#ifdef SOCK_NONBLOCK
+	fd = accept4(listener, sa, salen, SOCK_NONBLOCK);
+#else
+	fd = accept(listener, sa, salen);
+
+	if (fd >= 0 && set_nonblocking(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+#endif
+
+	return fd;
+}
+
+static void listener_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                           mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	io_listener *l = priv;
+	io_thread *t = l->t;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	u_io_conn *ic;
+	u_io_msg *m;
+	int i, fd;
+
+	for (i=0; i<l->batch; i++) {
+		addrlen = sizeof(addr);
+		memset(&addr, 0, addrlen);
+
+		fd = accept_nonblocking(l->fd, (struct sockaddr*) &addr, &addrlen);
+
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				to_main(IO_ERROR, NULL, errno, "accept");
+			return;
+		}
+
+		ic = calloc(1, sizeof(*ic));
+		ic->t = t;
+		ic->fd = fd;
+		ic->poll = mowgli_pollable_create(t->ev, fd, ic);
+
+		ic->next = t->conns;
+		if (t->conns != NULL)
+			t->conns->prev = ic;
+		t->conns = ic;
+
+		m = msg_new(IO_ACCEPT, ic, addrlen);
+		memcpy(m->data, &addr, addrlen);
+		m->ptr = l;
+		queue_push(&main_q, m);
+
+		set_read(ic, conn_read);
+	}
+}
+
+/* everything waiting to be written gets one more try, and then the
+   thread stays put until it is resumed */
+static void thread_pause(io_thread *t)
+{
+	u_io_conn *ic, *next;
+
+	for (ic = t->conns; ic; ic = next) {
+		next = ic->next;
+		if (ic->out != NULL)
+			conn_flush(ic);
+	}
+
+	pthread_mutex_lock(&pause_lock);
+	num_paused++;
+	pthread_cond_broadcast(&pause_cond);
+	while (pausing)
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	num_paused--;
+	pthread_mutex_unlock(&pause_lock);
+}
+
+static void thread_handle(io_thread *t, u_io_msg *m)
+{
+	u_io_conn *ic = m->ic;
+	io_listener *l;
+
+	switch (m->type) {
+	case IO_LISTEN:
+		l = m->ptr;
+		l->poll = mowgli_pollable_create(t->ev, l->fd, l);
+		mowgli_pollable_setselect(t->ev, l->poll,
+		                          MOWGLI_EVENTLOOP_IO_READ, listener_ready);
+		break;
+
+	case IO_OUTPUT:
+		if (ic->flags & IO_DEAD)
+			break;
+
+		if (ic->out_last != NULL)
+			ic->out_last->next = m;
+		else
+			ic->out = m;
+		ic->out_last = m;
+		m->next = NULL;
+
+		conn_flush(ic);
+		return;
+
+	case IO_CLOSE:
+		ic->flags |= IO_CLOSING;
+
+		if ((ic->flags & IO_DEAD) || ic->out == NULL) {
+			conn_release(ic);
+			break;
+		}
+
+		set_read(ic, NULL);
+		break;
+
+	case IO_RESUME:
+		if ((ic->flags & (IO_EOF | IO_DEAD | IO_CLOSING)) ||
+		    __atomic_load_n(&ic->in_flight, __ATOMIC_SEQ_CST) >= IO_INPUT_MAX)
+			break;
+
+		ic->flags &= ~IO_THROTTLED;
+		set_read(ic, conn_read);
+		break;
+
+	case IO_PAUSE:
+		thread_pause(t);
+		break;
+	}
+
+	free(m);
+}
+
+static void thread_wake(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                        mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	io_thread *t = priv;
+	u_io_msg *m;
+
+	queue_woken(&t->q);
+
+	while ((m = queue_pop(&t->q)) != NULL)
+		thread_handle(t, m);
+}
+
+static void *thread_main(void *priv)
+{
+	io_thread *t = priv;
+
+	mowgli_eventloop_run(t->ev);
+
+	return NULL;
+}
+
+/* main thread side */
+/* ---------------- */
+
+static void main_handle(u_io_msg *m)
+{
+	u_io_conn *ic = m->ic;
+	io_listener *l;
+
+	switch (m->type) {
+	case IO_ACCEPT:
+		l = m->ptr;
+		l->cb(ic, (struct sockaddr*) m->data, m->len);
+		break;
+
+	case IO_INPUT:
+		if (ic->ctx == NULL)
+			break;
+		ic->ctx->input(ic->priv, m);
+		return;
+
+	case IO_ERROR:
+		if (ic == NULL) {
+			u_log(LG_ERROR, "I/O thread: %s: %s", (char*) m->ptr,
+			      strerror(m->err));
+		} else if (ic->ctx != NULL) {
+			ic->ctx->error(ic->priv, m->ptr, m->err);
+		}
+		break;
+
+	case IO_WROTE:
+		if (ic->ctx != NULL)
+			ic->ctx->wrote(ic->priv, m->len);
+		break;
+
+	case IO_RELEASED:
+		free(ic);
+		break;
+	}
+
+	free(m);
+}
+
+static void main_wake_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                            mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	u_io_msg *m;
+
+	sync_time();
+
+	queue_woken(&main_q);
+
+	while ((m = queue_pop(&main_q)) != NULL)
+		main_handle(m);
+}
+
+int u_io_start(int n)
+{
+	sigset_t all, old;
+	io_thread *t;
+	int i, err;
+
+	if (num_threads > 0 || n < 1)
+		return -1;
+
+	if (queue_init(&main_q) < 0) {
+		u_perror("pipe");
+		return -1;
+	}
+
+	main_wake = mowgli_pollable_create(base_ev, main_q.wake[0], NULL);
+	mowgli_pollable_setselect(base_ev, main_wake, MOWGLI_EVENTLOOP_IO_READ,
+	                          main_wake_ready);
+
+	threads = calloc(n, sizeof(*threads));
+
+	/* signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (i=0; i<n; i++) {
+		t = &threads[i];
+
+		if (queue_init(&t->q) < 0) {
+			u_perror("pipe");
+			break;
+		}
+
+		t->ev = mowgli_eventloop_create();
+		t->wake = mowgli_pollable_create(t->ev, t->q.wake[0], t);
+		mowgli_pollable_setselect(t->ev, t->wake, MOWGLI_EVENTLOOP_IO_READ,
+		                          thread_wake);
+
+		if ((err = pthread_create(&t->thread, NULL, thread_main, t)) != 0) {
+			u_log(LG_ERROR, "pthread_create: %s", strerror(err));
+			break;
+		}
+
+		num_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (num_threads == 0)
+		return -1;
+
+	u_log(LG_INFO, "Started %d I/O threads", num_threads);
+
+	return 0;
+}
+
+int u_io_threads(void)
+{
+	return num_threads;
+}
+
+void u_io_listen(int thread, int fd, int batch, u_io_accept_cb *cb)
+{
+	io_listener *l;
+	u_io_msg *m;
+
+	l = calloc(1, sizeof(*l));
+	l->t = &threads[thread];
+	l->fd = fd;
+	l->batch = batch;
+	l->cb = cb;
+
+	m = msg_new(IO_LISTEN, NULL, 0);
+	m->ptr = l;
+	queue_push(&l->t->q, m);
+}
+
+void u_io_attach(u_io_conn *ic, u_io_ctx *ctx, void *priv)
+{
+	ic->ctx = ctx;
+	ic->priv = priv;
+}
+
+int u_io_fd(u_io_conn *ic)
+{
+	return ic->fd;
+}
+
+void u_io_write(u_io_conn *ic, u_sendq *sq)
+{
+	u_io_msg *m;
+
+	if (sq->size == 0)
+		return;
+
+	m = msg_new(IO_OUTPUT, ic, sq->size);
+	m->len = u_sendq_take(sq, m->data, m->len);
+
+	queue_push(&ic->t->q, m);
+}
+
+void u_io_consumed(u_io_conn *ic, size_t sz)
+{
+	size_t old;
+
+	old = __atomic_fetch_sub(&ic->in_flight, sz, __ATOMIC_SEQ_CST);
+
+	if (old >= IO_INPUT_MAX && old - sz < IO_INPUT_MAX)
+		queue_push(&ic->t->q, msg_new(IO_RESUME, ic, 0));
+}
+
+void u_io_close(u_io_conn *ic)
+{
+	ic->ctx = NULL;
+	ic->priv = NULL;
+
+	queue_push(&ic->t->q, msg_new(IO_CLOSE, ic, 0));
+}
+
+/* Input a thread has read but the main thread hasn't, partial lines
+   still on the thread, and output the sockets wouldn't take before the
+   pause are lost to an upgrade. */
+void u_io_pause(void)
+{
+	int i;
+
+	if (num_threads == 0)
+		return;
+
+	pthread_mutex_lock(&pause_lock);
+	pausing = true;
+	pthread_mutex_unlock(&pause_lock);
+
+	for (i=0; i<num_threads; i++)
+		queue_push(&threads[i].q, msg_new(IO_PAUSE, NULL, 0));
+
+	pthread_mutex_lock(&pause_lock);
+	while (num_paused < num_threads)
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+void u_io_resume(void)
+{
+	pthread_mutex_lock(&pause_lock);
+	pausing = false;
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+/* vim: set noet: */
@@ -6,11 +6,38 @@
 
 #include "ircd.h"
 
+/* How much input a link may consume each time it is serviced. A read
+   loop stops after max_bytes have been read or max_lines have been
+   dispatched, whichever comes first, and 0 means no limit. Server links
+   get a large budget so they catch up quickly during bursts, while user
+   links are kept small so one client can't starve the others. */
+
+struct read_budget {
+	size_t max_bytes;
+	int max_lines;
+};
+
+#define USER_READ_BYTES_DEFAULT   4096
+#define USER_READ_LINES_DEFAULT   20
+#define SERVER_READ_BYTES_DEFAULT 262144
+#define SERVER_READ_LINES_DEFAULT 0
+
+static struct read_budget user_budget = {
+	USER_READ_BYTES_DEFAULT, USER_READ_LINES_DEFAULT
+};
+static struct read_budget server_budget = {
+	SERVER_READ_BYTES_DEFAULT, SERVER_READ_LINES_DEFAULT
+};
+
+static mowgli_patricia_t *u_conf_input_handlers = NULL;
+
 static u_link *link_create(void)
 {
 	u_link *link;
 
 	link = calloc(1, sizeof(*link));
+	u_ibuf_init(&link->ibuf, IBUFSIZE, IBUFSIZE);
+	link->sendto_id = u_sendto_id_new();
 
 	return link;
 }
@@ -20,6 +47,8 @@ static void link_destroy(u_link *link)
 	if (link->pass != NULL)
 		free(link->pass);
 
+	u_ibuf_free(&link->ibuf);
+	u_sendto_id_free(link->sendto_id);
 	free(link);
 }
 
@@ -27,7 +56,7 @@ static void link_destroy(u_link *link)
 /* ---------------- */
 
 static void exceptional_quit(u_link *link, char *msg, ...);
-static void dispatch_lines(u_link*);
+static bool dispatch_lines(u_link*, int max, int *count);
 
 static void on_attach(u_conn *conn)
 {
@@ -77,25 +106,61 @@ static void on_sendq_full(u_conn *conn)
 	u_conn_shut_down(conn);
 }
 
+/* Reads until the socket is drained or the link's budget for this turn
+   runs out. If lines are left undispatched because of the line limit,
+   the link is put at the back of the queue to be resumed once everyone
+   else has had their turn, since the socket may not become readable
+   again to remind us. Leftover unread data needs no such help. */
 static void on_data_ready(u_conn *conn)
 {
 	u_link *link = conn->priv;
+	struct read_budget *budget;
+	uchar *buf;
+	size_t avail, nread = 0;
 	ssize_t sz;
+	int lines = 0;
 
-	if (link->ibuflen == IBUFSIZE) {
-		on_excess_flood(conn);
-		return;
-	}
+	budget = &user_budget;
+	if (link->type == LINK_SERVER)
+		budget = &server_budget;
 
-	sz = u_conn_recv(conn, link->ibuf + link->ibuflen,
-	                 IBUFSIZE - link->ibuflen);
+	/* server links may need to buffer a lot more during bursts */
+	link->ibuf.max = link->type == LINK_SERVER ? IBUFSIZE_SERVER : IBUFSIZE;
 
-	if (sz <= 0)
-		return;
+	/* finish whatever was left over from last time first. the line
+	   count carries across every read below, so max_lines bounds the
+	   whole turn */
+	if (dispatch_lines(link, budget->max_lines, &lines))
+		goto out_of_budget;
+
+	while (!budget->max_bytes || nread < budget->max_bytes) {
+		buf = u_ibuf_space(&link->ibuf, &avail);
 
-	link->ibuflen += sz;
+		if (avail == 0) {
+			on_excess_flood(conn);
+			return;
+		}
 
-	dispatch_lines(link);
+		sz = u_conn_recv(conn, buf, avail);
+
+		if (sz <= 0)
+			return;
+
+		u_ibuf_commit(&link->ibuf, sz);
+		nread += sz;
+
+		if (dispatch_lines(link, budget->max_lines, &lines))
+			goto out_of_budget;
+
+		/* a short read means there is nothing more waiting */
+		if (sz < avail)
+			return;
+	}
+
+	return;
+
+out_of_budget:
+	u_conn_resume_input(conn);
 }
 
 static void on_end_of_stream(u_conn *conn)
@@ -125,7 +190,7 @@ static void on_rdns_finish(u_conn *conn, const char *msg)
 
 	link->flags &= ~U_LINK_WAIT_RDNS;
 
-	dispatch_lines(link);
+	u_link_flush_input(link);
 }
 
 u_conn_ctx u_link_conn_ctx = {
@@ -173,74 +238,42 @@ static void exceptional_quit(u_link *link, char *msg, ...)
 	}
 }
 
-static void dispatch_lines(u_link *link)
+/* Dispatches lines until the buffer runs out or *count reaches max (0
+   for no limit), adding to *count as it goes. Returns true if it
+   stopped because of the limit. */
+static bool dispatch_lines(u_link *link, int max, int *count)
 {
-	uchar *buf;
-	size_t buflen;
-	uchar *s, *p;
+	char *s;
 	u_msg msg;
 
-	buf = link->ibuf;
-	buflen = link->ibuflen;
-
-	/* i don't really ever comment my code, as it's mostly very straight
-	   forward and relatively self-documenting. but C string processing
-	   is typically very hairy stuff and it can be difficult to decipher
-	   the intent of a chunk of code, so i commented it  --aji */
-
-	buf[buflen] = '\0';
-
-	while (buflen > 0) {
-		/* check wait flags on every iteration, as line dispatch
-		   can affect this */
-		if (link->flags & U_LINK_WAIT)
-			break;
-
-		/* find the next \r and \n */
-		s = memchr(buf, '\r', buflen);
-		p = memchr(buf, '\n', buflen);
-
-		/* if no line endings in buffer, we're done */
-		if (!s && !p)
+	/* check wait flags on every iteration, as line dispatch can
+	   affect this */
+	while (!(link->flags & U_LINK_WAIT)) {
+		if (max && *count >= max)
+			return true;
+
+		/* If executing this command causes an upgrade, u_cmd_invoke
+		 * will not return. The line is removed from the buffer
+		 * before it is dispatched so that it won't be serialized and
+		 * re-execute after the upgrade. */
+		if ((s = u_ibuf_line(&link->ibuf)) == NULL)
 			break;
 
-		/* if p is closer than s, then put p in s */
-		if (!s || (p && p < s))
-			s = p;
-		/* s now contains the closest line ending */
-
-		/* delete all contiguous line endings at s */
-		for (p = s; *p == '\r' || *p == '\n'; p++)
-			*p = '\0';
-		/* p now points at the start of the next line */
-
-		s = buf;
-		buf = p;
-		buflen = buflen - (p - s);
-		/* s now points to the current line, and buf and buflen
-		   describe the rest of the buffer */
-
-		/* If executing this command causes an upgrade, u_cmd_invoke will not
-		 * return. Indicate the length of the current message to the dump function
-		 * so that it won't be serialized and re-execute after upgrade.
-		 */
-		link->ibufskip = (p - link->ibuf);
+		(*count)++;
 
 		/* dispatch the line */
 		u_log(LG_DEBUG, "[%G] -> %s", link, s);
-		if (u_msg_parse(&msg, (char*)s) < 0)
+		if (u_msg_parse(&msg, s) < 0)
 			continue;
-		u_cmd_invoke(link, &msg, (char*)s);
+		u_cmd_invoke(link, &msg, s);
 	}
 
-	/* move remaining buffer contents to the start of the in buffer */
-	memmove(link->ibuf, link->ibuf + link->ibuflen - buflen, buflen);
-	link->ibuflen = buflen;
-	link->ibufskip = 0;
+	return false;
 }
 
 void u_link_flush_input(u_link *link) {
-	dispatch_lines(link);
+	int count = 0;
+	dispatch_lines(link, 0, &count);
 }
 
 /* user API */
@@ -278,33 +311,37 @@ void u_link_fatal(u_link *link, const char *msg)
 	u_conn_shut_down(link->conn);
 }
 
-void u_link_vf(u_link *link, const char *fmt, va_list va)
+uchar *u_link_get_buffer(u_link *link, size_t sz)
 {
 	uchar *buf;
-	size_t sz;
-	int type;
 
-	if (!link)
-		return;
-
-	if (link->sendq > 0 && link->conn->sendq.size + 512 > link->sendq) {
+	if (link->sendq > 0 && u_conn_queued(link->conn) + sz > link->sendq) {
 		on_sendq_full(link->conn);
-		return;
+		return NULL;
 	}
 
-	buf = u_conn_get_send_buffer(link->conn, 512);
+	buf = u_conn_get_send_buffer(link->conn, sz);
 
-	if (buf == NULL) {
+	if (buf == NULL)
 		on_sendq_full(link->conn);
-		return;
-	}
 
-	type = FMT_USER;
-	if (link->type == LINK_SERVER)
-		type = FMT_SERVER;
+	return buf;
+}
 
-	sz = vsnf(type, (char*)buf, 510, fmt, va);
+void u_link_end_buffer(u_link *link, size_t sz)
+{
+	u_conn_end_send_buffer(link->conn, sz);
+}
+
+/* reserves room for one line in the sendq */
+static uchar *line_begin(u_link *link)
+{
+	return u_link_get_buffer(link, 512);
+}
 
+/* sz is at most 510, leaving room for the \r\n */
+static void line_end(u_link *link, uchar *buf, size_t sz)
+{
 	buf[sz] = '\0';
 
 	u_log(LG_DEBUG, "[%G] <- %s", link, buf);
@@ -315,6 +352,27 @@ void u_link_vf(u_link *link, const char *fmt, va_list va)
 	u_conn_end_send_buffer(link->conn, sz);
 }
 
+void u_link_vf(u_link *link, const char *fmt, va_list va)
+{
+	uchar *buf;
+	size_t sz;
+	int type;
+
+	if (!link)
+		return;
+
+	if ((buf = line_begin(link)) == NULL)
+		return;
+
+	type = FMT_USER;
+	if (link->type == LINK_SERVER)
+		type = FMT_SERVER;
+
+	sz = vsnf(type, (char*)buf, 510, fmt, va);
+
+	line_end(link, buf, sz);
+}
+
 void u_link_f(u_link *link, const char *fmt, ...)
 {
 	va_list va;
@@ -324,10 +382,41 @@ void u_link_f(u_link *link, const char *fmt, ...)
 	va_end(va);
 }
 
+void u_link_put_shared(u_link *link, u_sendq_buf *buf)
+{
+	if (!link)
+		return;
+
+	if (link->sendq > 0 &&
+	    u_conn_queued(link->conn) + buf->size > link->sendq) {
+		on_sendq_full(link->conn);
+		return;
+	}
+
+	u_conn_put_shared(link->conn, buf);
+}
+
+void u_link_write(u_link *link, const uchar *data, size_t sz)
+{
+	if (!link)
+		return;
+
+	if (link->sendq > 0 && u_conn_queued(link->conn) + sz > link->sendq) {
+		on_sendq_full(link->conn);
+		return;
+	}
+
+	u_conn_send(link->conn, data, sz);
+}
+
+/* The prefix, number and target are copied in, and only the body of
+   the numeric goes through vsnf, straight into the sendq. */
 void u_link_vnum(u_link *link, const char *tgt, int num, va_list va)
 {
-	char buf[4096];
+	u_server_prefix *pfx;
+	uchar *buf;
 	char *fmt;
+	size_t sz, len;
 
 	if (!link)
 		return;
@@ -339,10 +428,33 @@ void u_link_vnum(u_link *link, const char *tgt, int num, va_list va)
 		return;
 	}
 
+	if ((buf = line_begin(link)) == NULL)
+		return;
+
+	pfx = &me_prefix_user;
+	if (link->type == LINK_SERVER)
+		pfx = &me_prefix_server;
+
+	memcpy(buf, pfx->s, pfx->len);
+	sz = pfx->len;
+
+	buf[sz++] = '0' + num / 100 % 10;
+	buf[sz++] = '0' + num / 10 % 10;
+	buf[sz++] = '0' + num % 10;
+	buf[sz++] = ' ';
+
+	/* nicks and UIDs, but don't trust it */
+	len = strlen(tgt);
+	if (len > 100)
+		len = 100;
+	memcpy(buf + sz, tgt, len);
+	sz += len;
+	buf[sz++] = ' ';
+
 	/* numerics are ALWAYS FMT_USER */
-	vsnf(FMT_USER, buf, 4096, fmt, va);
+	sz += vsnf(FMT_USER, (char*)buf + sz, 510 - sz, fmt, va);
 
-	u_link_f(link, ":%S %03d %s %s", &me, num, tgt, buf);
+	line_end(link, buf, sz);
 }
 
 int u_link_num(u_link *link, int num, ...)
@@ -379,6 +491,16 @@ struct u_link_origin {
 static mowgli_list_t all_origins;
 static mowgli_patricia_t *u_conf_listen_handlers = NULL;
 
+#define LISTEN_BACKLOG_DEFAULT 1024
+#define ACCEPT_BATCH_DEFAULT   64
+
+/* the listen() backlog, and how many connections to accept per wakeup */
+static int listen_backlog = LISTEN_BACKLOG_DEFAULT;
+static int accept_batch = ACCEPT_BATCH_DEFAULT;
+
+/* listening sockets handed to I/O threads */
+static int io_listeners = 0;
+
 static void accept_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                          mowgli_eventloop_io_dir_t dir, void *priv);
 
@@ -395,6 +517,12 @@ u_link_origin *u_link_origin_create_from_fd(mowgli_eventloop_t *ev, int fd)
 	if (set_cloexec(fd) < 0)
 		goto error;
 
+	/* accept_ready keeps accepting until the backlog is empty, which
+	   it can only find out from EAGAIN */
+	operation = "set non-blocking";
+	if (set_nonblocking(fd) < 0)
+		goto error;
+
 	u_log(LG_DEBUG, "u_link_origin_create_from_fd: %d", fd);
 
 	origin = malloc(sizeof(*origin));
@@ -416,6 +544,77 @@ error:
 	return NULL;
 }
 
+static void io_accept(u_io_conn *io, const struct sockaddr *sa,
+                      socklen_t salen)
+{
+	u_conn *conn;
+
+	conn = u_conn_adopt(&u_link_conn_ctx, link_create(), io, sa, salen);
+
+	u_log(LG_VERBOSE, "new connection from %s", conn->ip);
+}
+
+/* thread is -1 for a listener on the main loop. Every I/O thread gets a
+   socket of its own on the same address, and the kernel spreads new
+   connections across them. */
+static int origin_bind(mowgli_eventloop_t *ev, struct addrinfo *p,
+                       const char *port, int thread)
+{
+	const char *operation;
+	int fd, opt = 1;
+
+	operation = "socket";
+	if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+		goto error;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+	if (p->ai_family == PF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(int));
+
+#ifdef SO_REUSEPORT
+	operation = "set SO_REUSEPORT";
+	if (thread >= 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) < 0)
+		goto error;
+#endif
+
+	operation = "bind";
+	if (bind(fd, p->ai_addr, p->ai_addrlen) < 0)
+		goto error;
+	operation = "listen";
+	if (listen(fd, listen_backlog) < 0)
+		goto error;
+
+	if (thread >= 0) {
+		operation = "set close-on-exec";
+		if (set_cloexec(fd) < 0)
+			goto error;
+		operation = "set non-blocking";
+		if (set_nonblocking(fd) < 0)
+			goto error;
+
+		u_io_listen(thread, fd, accept_batch, io_accept);
+		io_listeners++;
+		return 0;
+	}
+
+	/* logs its own errors */
+	if (!u_link_origin_create_from_fd(ev, fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	u_log(LG_ERROR, "listen on %s port %s: %s: %s",
+	      p->ai_family == PF_INET6 ? "IPv6" : "IPv4", port,
+	      operation, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
 int u_link_origin_create(mowgli_eventloop_t *ev, ushort port)
 {
 	int return_code = -1;
@@ -434,34 +633,17 @@ int u_link_origin_create(mowgli_eventloop_t *ev, ushort port)
 	if (getaddrinfo(host_str, port_str, &hints, &res) < 0)
 		goto cleanup;
 
-	u_link_origin *origin = NULL;
 	struct addrinfo *p;
-	int fd, opt = 1;
+	int i, threads = u_io_threads();
 
 	for (p = res; p != NULL; p = p->ai_next) {
+		if (threads == 0 && origin_bind(ev, p, port_str, -1) == 0)
+			return_code = 0;
 
-		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
-			continue;
-
-		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
-		if (p->ai_family == PF_INET6)
-			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(int));
-
-		if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
-			close(fd);
-			continue;
-		}
-		if (listen(fd, 5) < 0) {
-			close(fd);
-			continue;
-		}
-		if (! (origin = u_link_origin_create_from_fd(ev, fd))) {
-			close(fd);
-			continue;
+		for (i=0; i<threads; i++) {
+			if (origin_bind(ev, p, port_str, i) == 0)
+				return_code = 0;
 		}
-
-		return_code = 0;
-
 	}
 
 cleanup:
@@ -471,29 +653,44 @@ cleanup:
 	return return_code;
 }
 
+/* After a netsplit or restart, thousands of clients can be waiting in
+   the backlog, so take as many as the batch allows while we're here.
+   The last accept in a batch almost always finds the backlog empty, so
+   the link it would have used is kept for the next connection rather
+   than created and destroyed on every wakeup. */
+static u_link *spare_link = NULL;
+
 static void accept_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                          mowgli_eventloop_io_dir_t dir, void *priv)
 {
 	mowgli_eventloop_pollable_t *poll = mowgli_eventloop_io_pollable(io);
 	u_conn *conn;
-	u_link *link;
+	int i;
 
 	sync_time();
 
-	link = link_create();
+	for (i=0; i<accept_batch; i++) {
+		if (spare_link == NULL)
+			spare_link = link_create();
 
-	if (!(conn = u_conn_accept(ev, &u_link_conn_ctx, link, 0, poll->fd))) {
-		link_destroy(link);
-		/* TODO: close listener, maybe? */
-		return;
-	}
+		conn = u_conn_accept(ev, &u_link_conn_ctx, spare_link,
+		                     0, poll->fd);
 
-	u_log(LG_VERBOSE, "new connection from %s", conn->ip);
+		if (conn == NULL) {
+			/* EAGAIN just means the backlog is empty. */
+			/* TODO: close listener on persistent errors, maybe? */
+			return;
+		}
+
+		spare_link = NULL;
+
+		u_log(LG_VERBOSE, "new connection from %s", conn->ip);
+	}
 }
 
 static void *conf_end(void *unused, void *unused2)
 {
-	if (all_origins.count != 0)
+	if (all_origins.count != 0 || io_listeners != 0)
 		return NULL;
 
 	u_log(LG_WARN, "No listeners! Opening one on 6667");
@@ -507,6 +704,60 @@ static void conf_listen(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce
 	u_conf_traverse(cf, ce->entries, u_conf_listen_handlers);
 }
 
+static void conf_listen_backlog(mowgli_config_file_t *cf,
+                                mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 1) {
+		u_log(LG_ERROR, "%s: invalid listen backlog", ce->vardata);
+		return;
+	}
+
+	/* the kernel silently caps this at somaxconn */
+	listen_backlog = n;
+}
+
+static void conf_listen_accept_batch(mowgli_config_file_t *cf,
+                                     mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 1) {
+		u_log(LG_ERROR, "%s: invalid accept batch", ce->vardata);
+		return;
+	}
+
+	accept_batch = n;
+}
+
+static void conf_listen_threads(mowgli_config_file_t *cf,
+                                mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 0) {
+		u_log(LG_ERROR, "%s: invalid number of threads", ce->vardata);
+		return;
+	}
+
+	if (n == 0)
+		return;
+
+#ifdef SO_REUSEPORT
+	if (u_io_threads() > 0) {
+		u_log(LG_WARN, "I/O threads are already running");
+		return;
+	}
+
+	if (u_io_start(n) < 0)
+		u_log(LG_ERROR, "Could not start I/O threads");
+#else
+	u_log(LG_ERROR, "I/O threads need SO_REUSEPORT, which this "
+	      "platform lacks");
+#endif
+}
+
 static void conf_listen_port(mowgli_config_file_t *cf,
                              mowgli_config_file_entry_t *ce)
 {
@@ -550,6 +801,49 @@ static void conf_listen_port(mowgli_config_file_t *cf,
 	}
 }
 
+static void conf_input(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_input_handlers);
+}
+
+static void conf_input_bytes(struct read_budget *budget, char *s)
+{
+	budget->max_bytes = parse_size(s);
+}
+
+static void conf_input_lines(struct read_budget *budget, char *s)
+{
+	budget->max_lines = atoi(s);
+	if (budget->max_lines < 0) {
+		u_log(LG_WARN, "%s: invalid line budget, using no limit", s);
+		budget->max_lines = 0;
+	}
+}
+
+static void conf_input_user_bytes(mowgli_config_file_t *cf,
+                                  mowgli_config_file_entry_t *ce)
+{
+	conf_input_bytes(&user_budget, ce->vardata);
+}
+
+static void conf_input_user_lines(mowgli_config_file_t *cf,
+                                  mowgli_config_file_entry_t *ce)
+{
+	conf_input_lines(&user_budget, ce->vardata);
+}
+
+static void conf_input_server_bytes(mowgli_config_file_t *cf,
+                                    mowgli_config_file_entry_t *ce)
+{
+	conf_input_bytes(&server_budget, ce->vardata);
+}
+
+static void conf_input_server_lines(mowgli_config_file_t *cf,
+                                    mowgli_config_file_entry_t *ce)
+{
+	conf_input_lines(&server_budget, ce->vardata);
+}
+
 /* main() API */
 /* ---------- */
 
@@ -562,6 +856,23 @@ int init_link(void)
 
 	u_conf_listen_handlers = mowgli_patricia_create(ascii_canonize);
 	u_conf_add_handler("port", conf_listen_port, u_conf_listen_handlers);
+	u_conf_add_handler("backlog", conf_listen_backlog, u_conf_listen_handlers);
+	u_conf_add_handler("accept_batch", conf_listen_accept_batch,
+	                   u_conf_listen_handlers);
+	u_conf_add_handler("threads", conf_listen_threads,
+	                   u_conf_listen_handlers);
+
+	u_conf_add_handler("input", conf_input, NULL);
+
+	u_conf_input_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("user_bytes", conf_input_user_bytes,
+	                   u_conf_input_handlers);
+	u_conf_add_handler("user_lines", conf_input_user_lines,
+	                   u_conf_input_handlers);
+	u_conf_add_handler("server_bytes", conf_input_server_bytes,
+	                   u_conf_input_handlers);
+	u_conf_add_handler("server_lines", conf_input_server_lines,
+	                   u_conf_input_handlers);
 
 	return 0;
 }
@@ -581,9 +892,8 @@ mowgli_json_t *u_link_to_json(u_link *link)
 	json_oseti  (jl, "type",  link->type);
 	json_osets  (jl, "pass",  link->pass);
 	json_oseti  (jl, "sendq", link->sendq);
-	json_oseto  (jl, "ck_sendto", u_cookie_to_json(&link->ck_sendto));
 	json_oseto  (jl, "conn",  u_conn_to_json(link->conn));
-	json_osetb64(jl, "ibuf",  link->ibuf + link->ibufskip, link->ibuflen - link->ibufskip);
+	json_osetb64(jl, "ibuf",  u_ibuf_data(&link->ibuf), u_ibuf_len(&link->ibuf));
 
 	switch (link->type) {
 		case LINK_USER:
@@ -605,7 +915,7 @@ mowgli_json_t *u_link_to_json(u_link *link)
 u_link *u_link_from_json(mowgli_json_t *jl)
 {
 	u_link *link;
-	mowgli_json_t *jcookie, *jconn;
+	mowgli_json_t *jconn;
 	mowgli_string_t *jpass, *jslinkname;
 	ssize_t sz;
 
@@ -618,11 +928,15 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 	if (json_ogeti(jl, "sendq", &link->sendq) < 0)
 		goto error;
 
-	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf, IBUFSIZE)) < 0)
+	if (link->type == LINK_SERVER) {
+		link->ibuf.max = IBUFSIZE_SERVER;
+		u_ibuf_reserve(&link->ibuf, IBUFSIZE_SERVER);
+	}
+
+	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf.data, link->ibuf.size)) < 0)
 		goto error;
 
-	link->ibuflen = sz;
-	link->ibuf[link->ibuflen] = '\0';
+	u_ibuf_commit(&link->ibuf, sz);
 
 	jpass = json_ogets(jl, "pass");
 	if (jpass) {
@@ -631,13 +945,6 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 		link->pass[jpass->pos] = '\0';
 	}
 
-	jcookie = json_ogeto(jl, "ck_sendto");
-	if (!jcookie)
-		goto error;
-
-	if (u_cookie_from_json(jcookie, &link->ck_sendto) < 0)
-		goto error;
-
 	jconn = json_ogeto(jl, "conn");
 	if (!jconn)
 		goto error;
@@ -681,10 +988,8 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 	return link;
 
 error:
-	if (link) {
-		free(link->pass);
-		free(link);
-	}
+	if (link)
+		link_destroy(link);
 	return NULL;
 }
 
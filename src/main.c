@@ -51,6 +51,7 @@ int init(void)
 	INIT(init_module);
 	INIT(init_hook);
 	INIT(init_conf);
+	INIT(init_sendq);
 	INIT(init_conn);
 	INIT(init_auth);
 	INIT(init_server);
@@ -11,43 +11,272 @@
 #define LEFT 0
 #define RIGHT 1
 
+/* deleted during a u_map_each, and left in the tree until it's over */
+#define N_PENDING 0x0001
+
 struct u_map_n {
 	void *key, *data;
-	int level;
+	int level, flags;
 	u_map_n *child[2];
-	/* .n is used by some iterators for keeping nodes in things like
-	   stacks or queues. it is for this reason that map iterations cannot
-	   be nested */
-	mowgli_node_t n;
 };
 
-static void n_key(u_map *map, u_map_n *n, void *k)
+/* node and key pools */
+/* ------------------- */
+
+/* Nodes and interned keys come from slabs carved into fixed size
+   blocks, with freed blocks kept on a per-pool free list. Slabs are
+   never given back, so once a pool has grown to a map's working set,
+   inserting and deleting costs no malloc. */
+
+#define POOL_SLAB_SIZE 4096
+
+typedef struct map_pool map_pool;
+
+struct map_pool {
+	char *name;
+	size_t size;
+
+	void *free;
+	uchar *slab;
+	size_t slab_left;
+
+	int in_use, num_free, slabs;
+	ulong hits, misses;
+};
+
+static map_pool node_pool = { "node", sizeof(u_map_n) };
+
+/* String keys are interned: every string-keyed map shares one
+   refcounted copy of each distinct key, so a key that goes into several
+   maps, or onto a pending delete list, is copied once. Pools must be in
+   order of increasing size, and their sizes multiples of a pointer. */
+
+struct key {
+	struct key *next;
+	uint hash, refs;
+	char s[];
+};
+
+static map_pool key_pools[] = {
+	{ "key32",  32  },
+	{ "key64",  64  },
+	{ "key128", 128 },
+};
+
+#define NUM_KEY_POOLS arraylen(key_pools)
+
+static struct key **key_table = NULL;
+static uint key_table_size = 0;
+static u_map_key_stats key_stats;
+
+static void *pool_get(map_pool *pool)
 {
-	if (map->flags & MAP_STRING_KEYS) {
-		if (n->key != NULL)
-			free(n->key);
+	void *p;
+
+	if (pool->free != NULL) {
+		p = pool->free;
+		pool->free = *(void**)p;
+		pool->num_free--;
+		pool->hits++;
+	} else {
+		if (pool->slab_left < pool->size) {
+			u_log(LG_DEBUG, "map %s pool: malloc()", pool->name);
+			pool->slab = malloc(POOL_SLAB_SIZE);
+			pool->slab_left = POOL_SLAB_SIZE;
+			pool->slabs++;
+			pool->misses++;
+		} else {
+			pool->hits++;
+		}
+
+		p = pool->slab;
+		pool->slab += pool->size;
+		pool->slab_left -= pool->size;
+	}
+
+	pool->in_use++;
+	return p;
+}
 
-		if (k != NULL) {
-			n->key = strdup(k); /* ;_; */
-			return;
+static void pool_put(map_pool *pool, void *p)
+{
+	*(void**)p = pool->free;
+	pool->free = p;
+	pool->num_free++;
+	pool->in_use--;
+}
+
+/* NULL for keys too long for any pool */
+static map_pool *key_pool(size_t len)
+{
+	int i;
+
+	for (i=0; i<NUM_KEY_POOLS; i++) {
+		if (sizeof(struct key) + len + 1 <= key_pools[i].size)
+			return &key_pools[i];
+	}
+
+	return NULL;
+}
+
+static uint key_hash(char *s)
+{
+	uint h = 2166136261u; /* FNV-1a */
+
+	for (; *s; s++)
+		h = (h ^ (uchar)*s) * 16777619u;
+
+	return h;
+}
+
+static void key_table_grow(void)
+{
+	struct key **old = key_table, *k, *next;
+	uint i, old_size = key_table_size;
+
+	key_table_size = old_size ? old_size * 2 : 64;
+	key_table = calloc(key_table_size, sizeof(*key_table));
+
+	for (i=0; i<old_size; i++) {
+		for (k=old[i]; k; k=next) {
+			next = k->next;
+			k->next = key_table[k->hash & (key_table_size - 1)];
+			key_table[k->hash & (key_table_size - 1)] = k;
 		}
 	}
 
-	n->key = k;
+	free(old);
 }
 
+static char *key_intern(char *s)
+{
+	struct key *k, **bucket;
+	map_pool *pool;
+	uint hash = key_hash(s);
+	size_t len;
+
+	if (key_table != NULL) {
+		bucket = &key_table[hash & (key_table_size - 1)];
+		for (k=*bucket; k; k=k->next) {
+			if (k->hash == hash && streq(k->s, s)) {
+				key_stats.hits++;
+				key_stats.refs++;
+				k->refs++;
+				return k->s;
+			}
+		}
+	}
+
+	if (key_stats.keys >= key_table_size)
+		key_table_grow();
+
+	len = strlen(s);
+	if ((pool = key_pool(len)) != NULL) {
+		k = pool_get(pool);
+	} else {
+		k = malloc(sizeof(*k) + len + 1);
+		key_stats.large++;
+	}
+
+	k->hash = hash;
+	k->refs = 1;
+	memcpy(k->s, s, len + 1);
+
+	bucket = &key_table[hash & (key_table_size - 1)];
+	k->next = *bucket;
+	*bucket = k;
+
+	key_stats.misses++;
+	key_stats.keys++;
+	key_stats.refs++;
+
+	return k->s;
+}
+
+/* another reference to a key that's already interned */
+static char *key_ref(char *s)
+{
+	struct key *k = (struct key*)(s - offsetof(struct key, s));
+
+	key_stats.refs++;
+	k->refs++;
+	return s;
+}
+
+static void key_release(char *s)
+{
+	struct key *k = (struct key*)(s - offsetof(struct key, s)), **p;
+	map_pool *pool;
+
+	key_stats.refs--;
+	if (--k->refs > 0)
+		return;
+
+	p = &key_table[k->hash & (key_table_size - 1)];
+	while (*p != k)
+		p = &(*p)->next;
+	*p = k->next;
+
+	key_stats.keys--;
+
+	if ((pool = key_pool(strlen(k->s))) != NULL) {
+		pool_put(pool, k);
+	} else {
+		key_stats.large--;
+		free(k);
+	}
+}
+
+static void pool_stats(map_pool *pool, u_map_pool_stats *st)
+{
+	st->name = pool->name;
+	st->size = pool->size;
+	st->in_use = pool->in_use;
+	st->num_free = pool->num_free;
+	st->hits = pool->hits;
+	st->misses = pool->misses;
+	st->mem = pool->slabs * POOL_SLAB_SIZE;
+}
+
+int u_map_get_pool_stats(int i, u_map_pool_stats *st)
+{
+	if (i == 0) {
+		pool_stats(&node_pool, st);
+		return 0;
+	}
+
+	if (i - 1 < NUM_KEY_POOLS) {
+		pool_stats(&key_pools[i - 1], st);
+		return 0;
+	}
+
+	return -1;
+}
+
+void u_map_get_key_stats(u_map_key_stats *st)
+{
+	memcpy(st, &key_stats, sizeof(*st));
+}
+
+/* nodes */
+/* ----- */
+
 static int n_cmp(u_map *map, void *k1, void *k2)
 {
+	if (k1 == k2)
+		return 0;
+
 	if (map->flags & MAP_STRING_KEYS)
 		return strcmp((char*)k1, (char*)k2);
 
-	return (long)k1 - (long)k2;
+	/* not a subtraction, which can overflow int for far apart pointers */
+	return (ulong)k1 < (ulong)k2 ? -1 : 1;
 }
 
 static void *n_clone(u_map *map, void *k)
 {
 	if (map->flags & MAP_STRING_KEYS)
-		return strdup(k);
+		return key_intern(k);
 
 	return k;
 }
@@ -55,18 +284,18 @@ static void *n_clone(u_map *map, void *k)
 static void n_free(u_map *map, void *k)
 {
 	if (map->flags & MAP_STRING_KEYS)
-		free(k);
+		key_release(k);
 }
 
 static u_map_n *u_map_n_new(u_map *map, void *key, void *data, int level)
 {
 	u_map_n *n;
 
-	n = malloc(sizeof(*n));
-	n->key = NULL;
-	n_key(map, n, key);
+	n = pool_get(&node_pool);
+	n->key = n_clone(map, key);
 	n->data = data;
 	n->level = level;
+	n->flags = 0;
 
 	n->child[0] = n->child[1] = NULL;
 
@@ -75,12 +304,147 @@ static u_map_n *u_map_n_new(u_map *map, void *key, void *data, int level)
 
 static void u_map_n_del(u_map *map, u_map_n *n)
 {
-	if ((map->flags & MAP_STRING_KEYS) && n->key)
-		free(n->key);
-	free(n);
+	n_free(map, n->key);
+	pool_put(&node_pool, n);
+}
+
+/* hashed maps */
+/* ----------- */
+
+/* Linear probing over a power of two table of key/value pairs, four to
+   a cache line. A lookup is a hash and usually a single line. Deleted
+   slots become tombstones rather than having later entries moved back,
+   so nothing moves except when the table is rebuilt, and that only
+   happens on insert. Rebuilding sizes the table for the live entries,
+   which also clears out tombstones. */
+
+struct u_map_slot {
+	void *key, *data;
+};
+
+static char tombstone;
+#define TOMB ((void*)&tombstone)
+
+#define HASH_MIN_CAP 8
+
+static uint h_hash(u_map *map, void *key)
+{
+	/* Fibonacci hashing. the low bits of pointers are mostly zero */
+	uint64_t h = (uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL;
+	return (uint)(h >> 32) & (map->cap - 1);
 }
 
-u_map *u_map_new(int string_keys)
+static u_map_slot *h_find(u_map *map, void *key)
+{
+	u_map_slot *slot;
+	uint i;
+
+	if (map->slots == NULL)
+		return NULL;
+
+	for (i = h_hash(map, key); ; i = (i + 1) & (map->cap - 1)) {
+		slot = &map->slots[i];
+		if (slot->key == key)
+			return slot;
+		if (slot->key == NULL)
+			return NULL;
+	}
+}
+
+/* key must not already be in the map */
+static void h_insert(u_map *map, void *key, void *data)
+{
+	u_map_slot *slot;
+	uint i;
+
+	for (i = h_hash(map, key); ; i = (i + 1) & (map->cap - 1)) {
+		slot = &map->slots[i];
+		if (slot->key == NULL || slot->key == TOMB)
+			break;
+	}
+
+	if (slot->key == NULL)
+		map->used++;
+
+	slot->key = key;
+	slot->data = data;
+}
+
+static void h_rebuild(u_map *map, uint live)
+{
+	u_map_slot *old = map->slots;
+	uint i, old_cap = map->cap;
+
+	/* at most half full afterwards */
+	map->cap = HASH_MIN_CAP;
+	while (map->cap < live * 2)
+		map->cap *= 2;
+
+	map->slots = calloc(map->cap, sizeof(*map->slots));
+	map->used = 0;
+	map->gen++;
+
+	for (i=0; i<old_cap; i++) {
+		if (old[i].key != NULL && old[i].key != TOMB)
+			h_insert(map, old[i].key, old[i].data);
+	}
+
+	free(old);
+}
+
+static void h_set(u_map *map, void *key, void *data)
+{
+	u_map_slot *slot = h_find(map, key);
+
+	if (slot != NULL) {
+		slot->data = data;
+		return;
+	}
+
+	/* keep live entries and tombstones under 3/4 of the table */
+	if ((map->used + 1) * 4 > map->cap * 3)
+		h_rebuild(map, map->size + 1);
+
+	map->size++;
+	h_insert(map, key, data);
+}
+
+static void *h_del(u_map *map, void *key)
+{
+	u_map_slot *slot = h_find(map, key);
+	void *data;
+
+	if (slot == NULL)
+		return NULL;
+
+	data = slot->data;
+	slot->key = TOMB;
+	slot->data = NULL;
+	map->size--;
+
+	return data;
+}
+
+/* returns the next live slot at or after *i */
+static u_map_slot *h_next(u_map *map, uint *i)
+{
+	u_map_slot *slot;
+
+	for (; *i < map->cap; (*i)++) {
+		slot = &map->slots[*i];
+		if (slot->key != NULL && slot->key != TOMB) {
+			(*i)++;
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/* trees */
+/* ----- */
+
+u_map *u_map_new(int flags)
 {
 	u_map *map;
 
@@ -88,10 +452,19 @@ u_map *u_map_new(int string_keys)
 	if (map == NULL)
 		return NULL;
 
+	if ((flags & MAP_STRING_KEYS) && (flags & MAP_HASHED)) {
+		u_log(LG_WARN, "map: string keys can't be hashed, using a tree");
+		flags &= ~MAP_HASHED;
+	}
+
 	map->iterdepth = 0;
-	map->flags = string_keys ? MAP_STRING_KEYS : 0;
+	map->flags = flags;
 	map->root = NULL;
 	map->size = 0;
+	map->gen = 0;
+
+	map->slots = NULL;
+	map->cap = map->used = 0;
 
 	return map;
 }
@@ -110,6 +483,7 @@ void u_map_free_n(u_map *map, u_map_n *n)
 void u_map_free(u_map *map)
 {
 	u_map_free_n(map, map->root);
+	free(map->slots);
 
 	free(map);
 }
@@ -129,6 +503,7 @@ static void delete_pending(u_map *map)
 	MOWGLI_LIST_FOREACH_SAFE(cur, tn, map->pending.head) {
 		u_log(LG_FINE, "DEL PENDING %p", cur->data);
 		map->root = aa_delete(map, map->root, cur->data);
+		map->gen++;
 		n_free(map, cur->data);
 		mowgli_list_delete(cur, &map->pending);
 	}
@@ -155,7 +530,15 @@ void u_map_each(u_map *map, u_map_cb_t *cb, void *priv)
 		clear_pending(map);
 	map->iterdepth++;
 
-	u_map_each_n(map, map->root, cb, priv);
+	if (map->flags & MAP_HASHED) {
+		u_map_slot *slot;
+		uint i = 0;
+
+		while ((slot = h_next(map, &i)) != NULL)
+			cb(map, slot->key, slot->data, priv);
+	} else {
+		u_map_each_n(map, map->root, cb, priv);
+	}
 
 	map->iterdepth--;
 	if (!map->iterdepth)
@@ -266,6 +649,7 @@ static u_map_n *aa_insert(u_map *map, u_map_n *tree, u_map_n *n)
 static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *k)
 {
 	u_map_n *n;
+	void *t;
 	int c;
 
 	if (tree == NULL)
@@ -284,9 +668,13 @@ static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *k)
 
 		c = !tree->child[LEFT] ? RIGHT : LEFT;
 		n = next(tree, c);
-		n_key(map, tree, n->key);
-		n_key(map, n, k); /* HEHEHE! */
+		/* swap keys rather than copying, so k stays valid even if it
+		   is this node's own key, and nothing needs reallocating */
+		t = tree->key;
+		tree->key = n->key;
+		n->key = t; /* HEHEHE! */
 		tree->data = n->data;
+		tree->flags = n->flags;
 		tree->child[c] = aa_delete(map, tree->child[c], k);
 	}
 
@@ -306,23 +694,38 @@ static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *k)
 
 void *u_map_get(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
+
+	if (map->flags & MAP_HASHED) {
+		u_map_slot *slot = h_find(map, key);
+		return slot == NULL ? NULL : slot->data;
+	}
+
+	n = dumb_fetch(map, key);
 	return n == NULL ? NULL : n->data;
 }
 
 void u_map_set(u_map *map, void *key, void *data)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
 
 	if (map->iterdepth)
 		abort();
 
+	if (map->flags & MAP_HASHED) {
+		h_set(map, key, data);
+		return;
+	}
+
+	n = dumb_fetch(map, key);
+
 	if (n != NULL) {
 		n->data = data;
 		return;
 	}
 
 	map->size++;
+	map->gen++;
 
 	n = u_map_n_new(map, key, data, 1);
 	map->root = aa_insert(map, map->root, n);
@@ -330,9 +733,14 @@ void u_map_set(u_map *map, void *key, void *data)
 
 void *u_map_del(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
 	void *data;
 
+	if (map->flags & MAP_HASHED)
+		return h_del(map, key);
+
+	n = dumb_fetch(map, key);
+
 	if (n == NULL)
 		return NULL;
 
@@ -350,9 +758,11 @@ void *u_map_del(u_map *map, void *key)
 	n->data = NULL;
 
 	if (map->iterdepth) {
+		n->flags |= N_PENDING;
 		add_pending(map, key);
 	} else {
 		map->root = aa_delete(map, map->root, key);
+		map->gen++;
 	}
 
 	return data;
@@ -393,59 +803,118 @@ static void map_dump_real(u_map *map, u_map_n *n, int depth)
 
 void u_map_dump(u_map *map)
 {
+	uint i;
+
+	if (map->flags & MAP_HASHED) {
+		for (i=0; i<map->cap; i++) {
+			if (map->slots[i].key == TOMB)
+				fprintf(stderr, "%u: (deleted)\n", i);
+			else if (map->slots[i].key != NULL)
+				fprintf(stderr, "%u: %p=%p\n", i, map->slots[i].key,
+				        map->slots[i].data);
+		}
+		return;
+	}
+
 	map_dump_real(map, map->root, 1);
 	fprintf(stderr, "\n");
 }
 
-static void try_queue(u_map_each_state *state, u_map_n *n)
+static void push_left(u_map_each_state *state, u_map_n *n)
 {
-	if (n == NULL)
-		return;
-
-	mowgli_node_add(n, &n->n, &state->list);
+	for (; n != NULL; n = n->child[LEFT])
+		state->stack[state->depth++] = n;
 }
 
-static u_map_n *try_dequeue(u_map_each_state *state)
+/* rebuilds the stack as the path to the first key after the last one
+   returned, which is what it would have been had the map not changed */
+static void reseek(u_map_each_state *state)
 {
+	u_map *map = state->map;
+	void *last = state->key;
 	u_map_n *n;
 
-	if (state->list.head == NULL)
-		return NULL;
+	state->depth = 0;
+	state->gen = map->gen;
 
-	n = state->list.head->data;
-	mowgli_node_delete(&n->n, &state->list);
+	if (!state->started) {
+		push_left(state, map->root);
+		return;
+	}
 
-	return n;
+	for (n = map->root; n != NULL; ) {
+		if (n_cmp(map, n->key, last) > 0) {
+			state->stack[state->depth++] = n;
+			n = n->child[LEFT];
+		} else {
+			n = n->child[RIGHT];
+		}
+	}
 }
 
 void u_map_each_start(u_map_each_state *state, u_map *map)
 {
 	state->map = map;
-	mowgli_list_init(&state->list);
-
-	if (!map->iterdepth)
-		clear_pending(map);
-	map->iterdepth++;
-
-	try_queue(state, map->root);
+	state->depth = 0;
+	state->started = false;
+	state->gen = map->gen;
+	state->key = NULL;
+	state->i = 0;
+
+	if (!(map->flags & MAP_HASHED))
+		push_left(state, map->root);
 }
 
 bool u_map_each_next(u_map_each_state *state, void **k, void **v)
 {
 	u_map_n *n;
 
-	if ((n = try_dequeue(state)) == NULL) {
-		state->map->iterdepth--;
-		if (!state->map->iterdepth)
-			delete_pending(state->map);
-		return false;
+	if (state->map->flags & MAP_HASHED) {
+		u_map_slot *slot = h_next(state->map, &state->i);
+
+		if (slot == NULL)
+			return false;
+
+		if (k) *k = slot->key;
+		if (v) *v = slot->data;
+		return true;
+	}
+
+	if (state->gen != state->map->gen)
+		reseek(state);
+
+	do {
+		if (state->depth == 0) {
+			u_map_each_end(state);
+			return false;
+		}
+
+		n = state->stack[--state->depth];
+		push_left(state, n->child[RIGHT]);
+	} while (n->flags & N_PENDING);
+
+	state->started = true;
+	if (state->map->flags & MAP_STRING_KEYS) {
+		/* the node may be deleted before the next call, and the key
+		   with it, so hold on to the key itself */
+		if (state->key != NULL)
+			key_release(state->key);
+		state->key = key_ref(n->key);
+	} else {
+		state->key = n->key;
 	}
 
 	if (k) *k = n->key;
 	if (v) *v = n->data;
 
-	try_queue(state, n->child[0]);
-	try_queue(state, n->child[1]);
-
 	return true;
 }
+
+void u_map_each_end(u_map_each_state *state)
+{
+	if (!(state->map->flags & MAP_STRING_KEYS) || state->key == NULL)
+		return;
+
+	key_release(state->key);
+	state->key = NULL;
+}
@@ -108,8 +108,10 @@ static const char *module_load_path(u_module **mp, const char *path,
 
 fail:
 	module_load_pop(m);
-	if (m->module)
+	if (m->module) {
+		vsnf_flush();
 		mowgli_module_close(m->module);
+	}
 	free(m);
 	return error;
 }
@@ -133,6 +135,8 @@ static void module_unload(u_module *m)
 	if (m->info->deinit)
 		m->info->deinit(m);
 
+	/* its format strings are about to go away */
+	vsnf_flush();
 	mowgli_module_close(m->module);
 	free(m);
 }
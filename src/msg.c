@@ -532,7 +532,7 @@ propagate:
 	MOWGLI_PATRICIA_FOREACH(sv, &state, servers_by_sid) {
 		if (!matchcase(mask, sv->name) || !sv->link)
 			continue;
-		u_sendto(sv->link, line);
+		u_sendto(sv->link, "%s", line);
 	}
 
 	return true;
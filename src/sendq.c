@@ -14,52 +14,231 @@
 
 #define CHUNK_IN_USE 0x0001
 
+typedef struct chunk_pool chunk_pool;
+
+/* A chunk either owns its data, in which case data points at the space
+   allocated after the header, or it refers to a shared buffer, in which
+   case data points into that buffer and the chunk holds one reference
+   to it. Shared chunks are never appended to. */
+
 struct u_sendq_chunk {
-	uchar data[SENDQ_CHUNK_SIZE];
 	ulong flags;
 	int start, end;
 	u_sendq_chunk *next;
+	chunk_pool *pool;
+	uchar *data;
+	u_sendq_buf *shared;
+	uchar space[];
+};
+
+/* the backlog is counted in 512 byte chunks. larger pools keep
+   proportionally fewer idle chunks, so each size class holds about the
+   same amount of idle memory */
+#define SENDQ_CHUNK_BACKLOG_DEFAULT 400
+#define SENDQ_BACKLOG_UNIT 512
+
+struct chunk_pool {
+	char *name;
+	size_t space;
+
+	u_sendq_chunk *free;
+	int num_free;
+	int num_alloc;
+	int max_free;
+
+	ulong hits, misses;
+};
+
+/* Owned chunks come in a few size classes. Links that only see the odd
+   line get small chunks, busy links get bigger ones, so idle users don't
+   pin a full chunk each and bursting servers don't need one chunk per
+   handful of lines. Pools must be in order of increasing size. */
+
+static chunk_pool data_pools[] = {
+	{ "small",  512                },
+	{ "medium", SENDQ_CHUNK_SIZE   },
+	{ "large",  SENDQ_CHUNK_MAX    },
 };
 
-#define SENDQ_CHUNK_BACKLOG_MAX 400
+#define NUM_DATA_POOLS arraylen(data_pools)
 
-static u_sendq_chunk *free_chunks = NULL;
-static int num_free_chunks = 0;
+static chunk_pool pool_ref = { "shared", 0 };
 
-static u_sendq_chunk *chunk_new(void)
+static int chunk_backlog = SENDQ_CHUNK_BACKLOG_DEFAULT;
+
+static size_t shared_mem = 0;
+
+static mowgli_patricia_t *u_conf_sendq_handlers = NULL;
+
+static u_sendq_chunk *chunk_new(chunk_pool *pool)
 {
 	u_sendq_chunk *chunk;
 
-	if (num_free_chunks) {
-		num_free_chunks--;
-		chunk = free_chunks;
-		free_chunks = chunk->next;
+	if (pool->num_free) {
+		pool->hits++;
+		pool->num_free--;
+		chunk = pool->free;
+		pool->free = chunk->next;
 	} else {
 		u_log(LG_DEBUG, "sendq chunk: malloc()");
-		chunk = malloc(sizeof(*chunk));
+		pool->misses++;
+		pool->num_alloc++;
+		chunk = malloc(sizeof(*chunk) + pool->space);
+		chunk->pool = pool;
 	}
 
 	chunk->flags = CHUNK_IN_USE;
 	chunk->next = NULL;
 	chunk->start = chunk->end = 0;
+	chunk->data = chunk->space;
+	chunk->shared = NULL;
 	return chunk;
 }
 
 static void chunk_free(u_sendq_chunk *chunk)
 {
+	chunk_pool *pool = chunk->pool;
+
 	if (!(chunk->flags & CHUNK_IN_USE)) /* prevent multiple free */
 		return;
 
-	if (num_free_chunks >= SENDQ_CHUNK_BACKLOG_MAX) {
+	if (chunk->shared != NULL) {
+		u_sendq_buf_unref(chunk->shared);
+		chunk->shared = NULL;
+	}
+
+	if (pool->num_free >= pool->max_free) {
 		u_log(LG_DEBUG, "sendq chunk: free()");
+		pool->num_alloc--;
 		free(chunk);
 		return;
 	}
 
 	chunk->flags &= ~CHUNK_IN_USE;
-	chunk->next = free_chunks;
-	free_chunks = chunk;
-	num_free_chunks ++;
+	chunk->next = pool->free;
+	pool->free = chunk;
+	pool->num_free ++;
+}
+
+static void pool_trim(chunk_pool *pool)
+{
+	u_sendq_chunk *chunk;
+
+	while (pool->num_free > pool->max_free) {
+		chunk = pool->free;
+		pool->free = chunk->next;
+		pool->num_free--;
+		pool->num_alloc--;
+		free(chunk);
+	}
+}
+
+/* Picks the pool for a new chunk that must hold at least sz bytes. The
+   queue's recent send rate (bytes per second) is used as a hint for how
+   much space it will want soon. */
+static chunk_pool *pick_pool(u_sendq *q, size_t sz)
+{
+	size_t want = sz > q->rate ? sz : q->rate;
+	int i;
+
+	for (i=0; i<NUM_DATA_POOLS-1; i++) {
+		if (want <= data_pools[i].space)
+			break;
+	}
+
+	return &data_pools[i];
+}
+
+/* Every second, the bytes queued during the previous second are folded
+   into the rate with a weight of 1/2. If the queue was idle for longer
+   than that, the old rate is forgotten. */
+static void sendq_account(u_sendq *q, size_t sz)
+{
+	if (q->rate_ts != NOW.tv_sec) {
+		if (NOW.tv_sec - q->rate_ts == 1)
+			q->rate = (q->rate + q->rate_acc) / 2;
+		else
+			q->rate = 0;
+		q->rate_acc = 0;
+		q->rate_ts = NOW.tv_sec;
+	}
+
+	q->rate_acc += sz;
+}
+
+/* shared buffers */
+/* -------------- */
+
+u_sendq_buf *u_sendq_buf_new(size_t sz)
+{
+	u_sendq_buf *buf;
+
+	buf = malloc(sizeof(*buf) + sz);
+	buf->refs = 1;
+	buf->size = 0;
+	buf->alloc = sz;
+
+	shared_mem += sizeof(*buf) + sz;
+
+	return buf;
+}
+
+u_sendq_buf *u_sendq_buf_ref(u_sendq_buf *buf)
+{
+	buf->refs++;
+	return buf;
+}
+
+void u_sendq_buf_unref(u_sendq_buf *buf)
+{
+	if (buf == NULL)
+		return;
+
+	if (--buf->refs == 0) {
+		shared_mem -= sizeof(*buf) + buf->alloc;
+		free(buf);
+	}
+}
+
+/* statistics */
+/* ---------- */
+
+static void pool_stats(chunk_pool *pool, u_sendq_pool_stats *st)
+{
+	st->name = pool->name;
+	st->chunk_size = pool->space;
+	st->in_use = pool->num_alloc - pool->num_free;
+	st->num_free = pool->num_free;
+	st->hits = pool->hits;
+	st->misses = pool->misses;
+	st->mem = pool->num_alloc * (sizeof(u_sendq_chunk) + pool->space);
+}
+
+int u_sendq_get_pool_stats(int i, u_sendq_pool_stats *st)
+{
+	if (i < NUM_DATA_POOLS) {
+		pool_stats(&data_pools[i], st);
+		return 0;
+	}
+
+	if (i == NUM_DATA_POOLS) {
+		pool_stats(&pool_ref, st);
+		return 0;
+	}
+
+	return -1;
+}
+
+size_t u_sendq_memory(void)
+{
+	u_sendq_pool_stats st;
+	size_t total = shared_mem;
+	int i;
+
+	for (i=0; u_sendq_get_pool_stats(i, &st) == 0; i++)
+		total += st.mem;
+
+	return total;
 }
 
 /* create, destroy */
@@ -85,11 +264,11 @@ void u_sendq_clear(u_sendq *q)
 /* buffer interaction */
 /* ------------------ */
 
-static u_sendq_chunk *sendq_append_chunk(u_sendq *q)
+static u_sendq_chunk *sendq_append_chunk(u_sendq *q, chunk_pool *pool)
 {
 	u_sendq_chunk *chunk;
 
-	chunk = chunk_new();
+	chunk = chunk_new(pool);
 
 	if (q->tail != NULL)
 		q->tail->next = chunk;
@@ -119,15 +298,15 @@ uchar *u_sendq_get_buffer(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk;
 
-	if (sz > SENDQ_CHUNK_SIZE) {
+	if (sz > SENDQ_CHUNK_MAX) {
 		/* TODO: this is not exactly robust */
 		return NULL;
 	}
 
 	chunk = q->tail;
 
-	if (!chunk || sz > (SENDQ_CHUNK_SIZE - chunk->end))
-		chunk = sendq_append_chunk(q);
+	if (!chunk || chunk->shared || sz > (chunk->pool->space - chunk->end))
+		chunk = sendq_append_chunk(q, pick_pool(q, sz));
 
 	return chunk->data + chunk->end;
 }
@@ -136,40 +315,163 @@ size_t u_sendq_end_buffer(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk = q->tail;
 
-	if (!chunk) {
+	if (!chunk || chunk->shared) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
 		return 0;
 	}
 
-	if (chunk->end + sz > SENDQ_CHUNK_SIZE) {
+	if (chunk->end + sz > chunk->pool->space) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
-		sz = SENDQ_CHUNK_SIZE - chunk->end;
+		sz = chunk->pool->space - chunk->end;
 	}
 
 	chunk->end += sz;
 	q->size += sz;
 
+	sendq_account(q, sz);
+
 	return sz;
 }
 
-#define NUM_IOVECS 32
+size_t u_sendq_put(u_sendq *q, const uchar *data, size_t sz)
+{
+	u_sendq_chunk *chunk;
+	size_t n, left = sz;
 
-int u_sendq_write(u_sendq *q, int fd)
+	while (left > 0) {
+		chunk = q->tail;
+
+		if (!chunk || chunk->shared || chunk->end == chunk->pool->space)
+			chunk = sendq_append_chunk(q, pick_pool(q, left));
+
+		n = chunk->pool->space - chunk->end;
+		if (n > left)
+			n = left;
+
+		memcpy(chunk->data + chunk->end, data, n);
+		chunk->end += n;
+		q->size += n;
+
+		data += n;
+		left -= n;
+	}
+
+	sendq_account(q, sz);
+
+	return sz;
+}
+
+size_t u_sendq_put_shared(u_sendq *q, u_sendq_buf *buf)
+{
+	u_sendq_chunk *chunk;
+
+	if (buf->size == 0)
+		return 0;
+
+	chunk = sendq_append_chunk(q, &pool_ref);
+	chunk->shared = u_sendq_buf_ref(buf);
+	chunk->data = buf->data;
+	chunk->end = buf->size;
+
+	q->size += buf->size;
+
+	sendq_account(q, buf->size);
+
+	return buf->size;
+}
+
+/* copies up to sz bytes off the front of the queue */
+size_t u_sendq_take(u_sendq *q, uchar *buf, size_t sz)
+{
+	u_sendq_chunk *ch;
+	size_t n, taken = 0;
+
+	while (taken < sz && (ch = q->head) != NULL) {
+		n = ch->end - ch->start;
+		if (n > sz - taken)
+			n = sz - taken;
+
+		memcpy(buf + taken, ch->data + ch->start, n);
+		taken += n;
+		ch->start += n;
+
+		if (ch->start == ch->end)
+			sendq_delete_chunk(q, ch);
+	}
+
+	q->size -= taken;
+
+	return taken;
+}
+
+#ifdef IOV_MAX
+# if IOV_MAX < 1024
+#  define NUM_IOVECS IOV_MAX
+# endif
+#endif
+#ifndef NUM_IOVECS
+# define NUM_IOVECS 1024
+#endif
+
+/* Broadcast lines are queued by reference, one chunk each, so a burst
+   of them leaves a run of small chunks scattered over as many shared
+   buffers. When the queue is written, such a run is copied into the
+   coalescing buffer and handed to the kernel as one iovec. The queue
+   itself is left alone, so a short write is handled as usual. */
+#define COALESCE_LINE_MAX 512
+#define COALESCE_SIZE     16384
+
+static uchar coalesce_buf[COALESCE_SIZE];
+
+static inline bool coalescable(u_sendq_chunk *ch)
+{
+	return ch != NULL && ch->end - ch->start <= COALESCE_LINE_MAX;
+}
+
+/* a single writev over as much of the queue as fits in one iovec array.
+   *offered is set to the number of bytes handed to the kernel */
+static ssize_t sendq_writev(u_sendq *q, int fd, size_t *offered)
 {
 	u_sendq_chunk *ch = q->head;
 	struct iovec iov[NUM_IOVECS];
 	int iovcnt = 0;
-	ssize_t sz;
+	size_t used = 0, len;
+	ssize_t sz, ret;
+
+	*offered = 0;
+
+	for (; iovcnt < NUM_IOVECS && ch; iovcnt++) {
+		len = ch->end - ch->start;
+
+		if (coalescable(ch) && coalescable(ch->next) &&
+		    used + len <= COALESCE_SIZE) {
+			iov[iovcnt].iov_base = coalesce_buf + used;
+			iov[iovcnt].iov_len = 0;
+
+			do {
+				memcpy(coalesce_buf + used, ch->data + ch->start, len);
+				used += len;
+				iov[iovcnt].iov_len += len;
+				ch = ch->next;
+				len = ch ? ch->end - ch->start : 0;
+			} while (coalescable(ch) && used + len <= COALESCE_SIZE);
+
+			*offered += iov[iovcnt].iov_len;
+			u_log(LG_FINE, "  sendq: coalesced -> iov %p +%04u",
+			      iov[iovcnt].iov_base, iov[iovcnt].iov_len);
+			continue;
+		}
 
-	for (; iovcnt < NUM_IOVECS && ch; iovcnt++, ch = ch->next) {
 		iov[iovcnt].iov_base = ch->data + ch->start;
-		iov[iovcnt].iov_len = ch->end - ch->start;
+		iov[iovcnt].iov_len = len;
+		*offered += len;
 		u_log(LG_FINE, "  sendq: ch %p %04d-%04d -> iov %p +%04u",
 		      ch->data, ch->start, ch->end,
 		      iov[iovcnt].iov_base, iov[iovcnt].iov_len);
+		ch = ch->next;
 	}
 
-	sz = writev(fd, iov, iovcnt);
+	ret = sz = writev(fd, iov, iovcnt);
 
 	if (sz < 0)
 		return sz;
@@ -190,6 +492,97 @@ int u_sendq_write(u_sendq *q, int fd)
 		sendq_delete_chunk(q, ch);
 	}
 
+	return ret;
+}
+
+int u_sendq_write(u_sendq *q, int fd)
+{
+	size_t offered;
+	ssize_t sz;
+
+	sz = sendq_writev(q, fd, &offered);
+
+	if (sz < 0)
+		return sz;
+
+	return 0;
+}
+
+int u_sendq_flush(u_sendq *q, int fd)
+{
+	size_t offered;
+	ssize_t sz;
+
+	while (q->head != NULL) {
+		sz = sendq_writev(q, fd, &offered);
+
+		if (sz < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return 0;
+			return sz;
+		}
+
+		/* a short write means the socket buffer is full */
+		if (sz < offered)
+			break;
+	}
+
+	return 0;
+}
+
+/* configuration */
+/* ------------- */
+
+static void conf_sendq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_sendq_handlers);
+}
+
+static void pool_set_backlog(chunk_pool *pool)
+{
+	if (pool->space <= SENDQ_BACKLOG_UNIT) {
+		pool->max_free = chunk_backlog;
+	} else {
+		pool->max_free = chunk_backlog * SENDQ_BACKLOG_UNIT / pool->space;
+		if (pool->max_free == 0 && chunk_backlog > 0)
+			pool->max_free = 1;
+	}
+
+	pool_trim(pool);
+}
+
+static void set_backlog(void)
+{
+	int i;
+
+	for (i=0; i<NUM_DATA_POOLS; i++)
+		pool_set_backlog(&data_pools[i]);
+	pool_set_backlog(&pool_ref);
+}
+
+static void conf_sendq_backlog(mowgli_config_file_t *cf,
+                               mowgli_config_file_entry_t *ce)
+{
+	chunk_backlog = atoi(ce->vardata);
+	if (chunk_backlog < 0) {
+		u_log(LG_WARN, "sendq backlog %d invalid. Using %d",
+		      chunk_backlog, SENDQ_CHUNK_BACKLOG_DEFAULT);
+		chunk_backlog = SENDQ_CHUNK_BACKLOG_DEFAULT;
+	}
+
+	set_backlog();
+}
+
+int init_sendq(void)
+{
+	u_conf_sendq_handlers = mowgli_patricia_create(ascii_canonize);
+
+	u_conf_add_handler("sendq", conf_sendq, NULL);
+	u_conf_add_handler("backlog", conf_sendq_backlog, u_conf_sendq_handlers);
+
+	set_backlog();
+
 	return 0;
 }
 
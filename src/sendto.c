@@ -6,83 +6,156 @@
 
 #include "ircd.h"
 
-static u_cookie ck_sendto;
+/* Dedupe */
+/* ------ */
 
-static char *ln_user, buf_user[1024];
-static char *ln_serv, buf_serv[1024];
+/* Every link gets a small id when it is created, and the epoch of the
+   last send it was part of is kept in a dense array indexed by that id.
+   Checking a recipient touches one entry of the array instead of the
+   u_link itself. u_sendto_start begins a new epoch. If the counter ever
+   wraps, the array is swept, or an entry left over from four billion
+   sends ago could match again. Ids of destroyed links are reused, so the
+   array stays about as large as the number of links. */
 
-void u_sendto_start(void)
+static uint32_t epoch = 1;
+static uint32_t *epochs = NULL;
+static uint nids = 0, ids_alloc = 0;
+
+static uint *free_ids = NULL;
+static uint nfree = 0, free_alloc = 0;
+
+uint u_sendto_id_new(void)
 {
-	u_cookie_inc(&ck_sendto);
-	ln_user = NULL;
-	ln_serv = NULL;
+	uint id;
+
+	if (nfree > 0) {
+		id = free_ids[--nfree];
+	} else {
+		if (nids == ids_alloc) {
+			ids_alloc = ids_alloc ? ids_alloc * 2 : 1024;
+			epochs = realloc(epochs, ids_alloc * sizeof(*epochs));
+		}
+		id = nids++;
+	}
+
+	epochs[id] = 0;
+	return id;
 }
 
-void u_sendto_skip(u_link *link)
+void u_sendto_id_free(uint id)
 {
-	if (!link)
-		return;
+	if (nfree == free_alloc) {
+		free_alloc = free_alloc ? free_alloc * 2 : 256;
+		free_ids = realloc(free_ids, free_alloc * sizeof(*free_ids));
+	}
 
-	if (u_cookie_cmp(&link->ck_sendto, &ck_sendto) < 0)
-		u_cookie_cpy(&link->ck_sendto, &ck_sendto);
+	free_ids[nfree++] = id;
 }
 
-static int want_send(uint type, u_link *link)
+static inline bool seen(u_link *link)
 {
-	switch (type) {
-	case ST_ALL:
-		return 1;
+	return epochs[link->sendto_id] == epoch;
+}
 
-	case ST_USERS:
-	case ST_SERVERS:
-		switch (link->type) {
-		case LINK_NONE:
-		case LINK_USER:
-			return type == ST_USERS;
+static inline void mark(u_link *link)
+{
+	epochs[link->sendto_id] = epoch;
+}
 
-		case LINK_SERVER:
-			return type == ST_SERVERS;
-		}
-		return 0;
+/* broadcast lines are rendered once per format type into a shared
+   buffer, which is then queued by reference on every recipient */
+struct line {
+	char text[512];
+	u_sendq_buf *buf;
+};
+
+static struct line ln_user;
+static struct line ln_serv;
+
+static void ln_release(void)
+{
+	u_sendq_buf_unref(ln_user.buf);
+	u_sendq_buf_unref(ln_serv.buf);
+	ln_user.buf = NULL;
+	ln_serv.buf = NULL;
+}
+
+void u_sendto_start(void)
+{
+	if (++epoch == 0) {
+		memset(epochs, 0, nids * sizeof(*epochs));
+		epoch = 1;
 	}
 
-	return 0;
+	ln_release();
+}
+
+void u_sendto_skip(u_link *link)
+{
+	if (!link)
+		return;
+
+	mark(link);
 }
 
-static char *ln(u_link *link, char *fmt, va_list va_orig)
+static struct line *ln(u_link *link, char *fmt, va_list va_orig)
 {
+	struct line *l;
 	va_list va;
+	int type, sz;
 
 	switch (link->type) {
 	case LINK_NONE:
 	case LINK_USER:
-		if (ln_user != NULL)
-			return ln_user;
-		ln_user = buf_user;
-		va_copy(va, va_orig);
-		vsnf(FMT_USER, buf_user, 1024, fmt, va);
-		va_end(va);
-		return ln_user;
+		l = &ln_user;
+		type = FMT_USER;
+		break;
 
 	case LINK_SERVER:
-		if (ln_serv != NULL)
-			return ln_serv;
-		ln_serv = buf_serv;
-		va_copy(va, va_orig);
-		vsnf(FMT_SERVER, buf_serv, 1024, fmt, va);
-		va_end(va);
-		return ln_serv;
+		l = &ln_serv;
+		type = FMT_SERVER;
+		break;
+
+	default:
+		return NULL;
 	}
 
-	return NULL;
+	if (l->buf != NULL)
+		return l;
+
+	/* same limits as u_link_vf */
+	va_copy(va, va_orig);
+	sz = vsnf(type, l->text, 510, fmt, va);
+	va_end(va);
+
+	l->buf = u_sendq_buf_new(sz + 2);
+	memcpy(l->buf->data, l->text, sz);
+	l->buf->data[sz++] = '\r';
+	l->buf->data[sz++] = '\n';
+	l->buf->size = sz;
+
+	return l;
+}
+
+static void send_line(u_link *link, struct line *l)
+{
+	if (l == NULL)
+		return;
+	if (seen(link))
+		return;
+	mark(link);
+
+	u_log(LG_DEBUG, "[%G] <- %s", link, l->text);
+
+	u_link_put_shared(link, l->buf);
 }
 
 void u_sendto(u_link *link, char *fmt, ...)
 {
 	va_list va;
-	if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+	if (seen(link))
 		return;
-	u_cookie_cpy(&link->ck_sendto, &ck_sendto);
+	mark(link);
 	va_start(va, fmt);
 	u_link_vf(link, fmt, va);
 	va_end(va);
@@ -96,8 +169,10 @@ void u_sendto_chan(u_chan *c, u_link *exclude, uint type, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_CHAN(&st, c, exclude, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		send_line(link, ln(link, fmt, va));
 	va_end(va);
+
+	ln_release();
 }
 
 void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
@@ -108,8 +183,10 @@ void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_VISIBLE(&st, u, u->link, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		send_line(link, ln(link, fmt, va));
 	va_end(va);
+
+	ln_release();
 }
 
 void u_sendto_servers(u_link *exclude, char *fmt, ...)
@@ -120,8 +197,10 @@ void u_sendto_servers(u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_SERVERS(&st, exclude, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		send_line(link, ln(link, fmt, va));
 	va_end(va);
+
+	ln_release();
 }
 
 void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
@@ -136,9 +215,11 @@ void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
 	va_start(va, fmt);
 	MOWGLI_LIST_FOREACH(n, list->head) {
 		u_link *link = n->data;
-		u_sendto(link, "%s", ln(link, fmt, va));
+		send_line(link, ln(link, fmt, va));
 	}
 	va_end(va);
+
+	ln_release();
 }
 
 void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
@@ -153,8 +234,163 @@ void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_MAP_EACH(&state, map, NULL, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		send_line(link, ln(link, fmt, va));
 	va_end(va);
+
+	ln_release();
+}
+
+static void recips_range(u_sendto_state *state, u_chan *c)
+{
+	u_chan_recips *r;
+
+	state->recips = r = u_chan_recips_get(c);
+
+	switch (state->type) {
+	case ST_USERS:
+		state->i = 0;
+		state->end = r->nusers;
+		break;
+	case ST_SERVERS:
+		state->i = r->nusers;
+		state->end = r->nlinks;
+		break;
+	default:
+		state->i = 0;
+		state->end = r->nlinks;
+		break;
+	}
+}
+
+/* returns the next link in the current recipient range that hasn't
+   been sent to yet, or NULL once the range runs out */
+static u_link *recips_next(u_sendto_state *state)
+{
+	u_link *link;
+
+	while (state->i < state->end) {
+		link = state->recips->links[state->i++];
+
+		if (seen(link))
+			continue;
+
+		return link;
+	}
+
+	u_chan_recips_unref(state->recips);
+	state->recips = NULL;
+	return NULL;
+}
+
+/* Netsplits */
+/* --------- */
+
+struct split_pair {
+	u_link *link;
+	int user;
+};
+
+static int split_pair_cmp(const void *va, const void *vb)
+{
+	const struct split_pair *a = va, *b = vb;
+
+	if (a->link != b->link)
+		return a->link < b->link ? -1 : 1;
+	return a->user - b->user;
+}
+
+/* Every QUIT is rendered once. Then one pass over the lost users
+   collects (recipient, user) pairs from the channels' recipient arrays,
+   and after sorting them by recipient, each recipient's QUITs are
+   copied out together and written with a single u_link_write. */
+void u_sendto_split(u_user **users, int n, char *reason)
+{
+	struct split_pair *pairs = NULL;
+	int npairs = 0, pairs_alloc = 0;
+	size_t *offs, *lens, total = 0, alloc = 0;
+	char *text = NULL, line[512];
+	uchar *buf = NULL;
+	size_t buf_alloc = 0, sz;
+	u_chan_recips *r;
+	u_chanuser *cu;
+	u_user *u;
+	int i, j, k, ci;
+
+	if (n == 0)
+		return;
+
+	offs = malloc(n * sizeof(*offs));
+	lens = malloc(n * sizeof(*lens));
+
+	for (i=0; i<n; i++) {
+		sz = snf(FMT_USER, line, 510, ":%H QUIT :%s", users[i], reason);
+		line[sz++] = '\r';
+		line[sz++] = '\n';
+
+		if (total + sz > alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			text = realloc(text, alloc);
+		}
+
+		memcpy(text + total, line, sz);
+		offs[i] = total;
+		lens[i] = sz;
+		total += sz;
+	}
+
+	for (i=0; i<n; i++) {
+		u = users[i];
+		u_sendto_start();
+
+		U_USER_EACH_CHAN(u, ci, cu) {
+			r = u_chan_recips_get(cu->c);
+			for (j=0; j<r->nusers; j++) {
+				u_link *link = r->links[j];
+
+				if (seen(link))
+					continue;
+				mark(link);
+
+				if (npairs == pairs_alloc) {
+					pairs_alloc = pairs_alloc ? pairs_alloc * 2 : 256;
+					pairs = realloc(pairs, pairs_alloc * sizeof(*pairs));
+				}
+				pairs[npairs].link = link;
+				pairs[npairs].user = i;
+				npairs++;
+			}
+			u_chan_recips_unref(r);
+		}
+	}
+
+	qsort(pairs, npairs, sizeof(*pairs), split_pair_cmp);
+
+	for (i=0; i<npairs; i=j) {
+		sz = 0;
+		for (j=i; j<npairs && pairs[j].link == pairs[i].link; j++)
+			sz += lens[pairs[j].user];
+
+		if (sz > buf_alloc) {
+			buf_alloc = sz;
+			buf = realloc(buf, buf_alloc);
+		}
+
+		sz = 0;
+		for (k=i; k<j; k++) {
+			memcpy(buf + sz, text + offs[pairs[k].user],
+			       lens[pairs[k].user]);
+			sz += lens[pairs[k].user];
+		}
+
+		u_log(LG_DEBUG, "[%G] <- %d netsplit QUITs", pairs[i].link, j - i);
+		u_link_write(pairs[i].link, buf, sz);
+	}
+
+	free(buf);
+	free(pairs);
+	free(text);
+	free(lens);
+	free(offs);
 }
 
 void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
@@ -171,31 +407,27 @@ void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
 		u_sendto_skip(exclude);
 
 	state->type = type;
-
-	u_map_each_start(&state->members, c->members);
+	recips_range(state, c);
 }
 
 bool u_sendto_chan_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
-
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu))
+	if ((*link_ret = recips_next(state)) == NULL) {
+		state->type = ST_STOP;
 		return false;
+	}
 
-	if (!want_send(state->type, u->link))
-		goto next_link;
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
-
-	*link_ret = u->link;
 	return true;
 }
 
+/* Walks the recipient arrays of each of the user's channels rather
+   than their member trees. Each channel contributes one entry per local
+   member plus one per server link, so a user in many big channels full
+   of remote users costs a handful of entries per channel instead of
+   every member. */
 void u_sendto_visible_start(u_sendto_state *state, u_user *u,
                             u_link *exclude, uint type)
 {
@@ -211,39 +443,32 @@ void u_sendto_visible_start(u_sendto_state *state, u_user *u,
 
 	state->type = type;
 
-	u_map_each_start(&state->chans, u->channels);
+	state->u = u;
+	state->chan_i = 0;
 	state->c = NULL;
+	state->recips = NULL;
 }
 
 bool u_sendto_visible_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
+	u_user *u = state->u;
 
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!state->c) {
-		if (!u_map_each_next(&state->chans, (void**)&state->c, NULL))
-			return false;
-		if (!state->c)
-			return false;
-		u_map_each_start(&state->members, state->c->members);
-	}
+	for (;;) {
+		if (state->recips == NULL) {
+			if (state->chan_i >= u->nchannels) {
+				state->type = ST_STOP;
+				return false;
+			}
+			state->c = u->channels[state->chan_i++]->c;
+			recips_range(state, state->c);
+		}
 
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu)) {
-		state->c = NULL;
-		goto next_link;
+		if ((*link_ret = recips_next(state)) != NULL)
+			return true;
 	}
-
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
-	if (!want_send(state->type, u->link))
-		goto next_link;
-
-	*link_ret = u->link;
-	return true;
 }
 
 void u_sendto_servers_start(u_sendto_state *state, u_link *exclude)
@@ -268,7 +493,7 @@ next_link:
 
 	if (!IS_SERVER_LOCAL(sv) || !sv->link)
 		goto next_link;
-	if (!u_cookie_cmp(&sv->link->ck_sendto, &ck_sendto))
+	if (seen(sv->link))
 		goto next_link;
 
 	*link_ret = sv->link;
@@ -277,7 +502,5 @@ next_link:
 
 int init_sendto(void)
 {
-	u_cookie_reset(&ck_sendto);
-
 	return 0;
 }
@@ -8,8 +8,11 @@
 
 mowgli_patricia_t *servers_by_sid;
 mowgli_patricia_t *servers_by_name;
+u_hash server_index;
 
 u_server me;
+u_server_prefix me_prefix_user;
+u_server_prefix me_prefix_server;
 mowgli_list_t my_motd;
 mowgli_list_t my_admininfo;
 char my_net_name[MAXNETNAME+1];
@@ -20,6 +23,7 @@ static void load_motd(char *val)
 	FILE *f;
 
 	u_log(LG_INFO, "Loading MOTD from %s", val);
+	u_user_reply_cache_clear();
 
 	f = fopen(val, "r");
 	if (f == NULL) {
@@ -40,6 +44,18 @@ static void load_motd(char *val)
 	fclose(f);
 }
 
+static void render_prefix(u_server_prefix *pfx, char *s)
+{
+	pfx->len = snprintf(pfx->s, sizeof(pfx->s), ":%s ", s);
+}
+
+static void render_prefixes(void)
+{
+	render_prefix(&me_prefix_user, me.name);
+	render_prefix(&me_prefix_server, me.sid);
+	u_user_reply_cache_clear();
+}
+
 static void server_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 {
 	mowgli_config_file_entry_t *cce;
@@ -47,9 +63,12 @@ static void server_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce
 	MOWGLI_ITER_FOREACH(cce, ce->entries) {
 		if (streq(cce->varname, "name")) {
 			mowgli_patricia_delete(servers_by_name, me.name);
+			u_hash_del(&server_index, &me.name_ent);
 			u_strlcpy(me.name, cce->vardata, MAXSERVNAME+1);
 			mowgli_patricia_add(servers_by_name, me.name, &me);
+			u_hash_add(&server_index, &me.name_ent, me.name, &me);
 			u_log(LG_DEBUG, "server_conf: me.name=%s", me.name);
+			render_prefixes();
 		} else if (streq(cce->varname, "net")) {
 			u_strlcpy(my_net_name, cce->vardata, MAXNETNAME+1);
 			u_log(LG_DEBUG, "server_conf: me.net=%s", my_net_name);
@@ -58,6 +77,7 @@ static void server_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce
 			u_strlcpy(me.sid, cce->vardata, 4);
 			mowgli_patricia_add(servers_by_sid, me.sid, &me);
 			u_log(LG_DEBUG, "server_conf: me.sid=%s", me.sid);
+			render_prefixes();
 		} else if (streq(cce->varname, "desc")) {
 			u_strlcpy(me.desc, cce->vardata, MAXSERVDESC+1);
 			u_log(LG_DEBUG, "server_conf: me.desc=%s", me.desc);
@@ -85,7 +105,7 @@ u_server *u_server_by_sid(const char *sid)
 
 u_server *u_server_by_name(const char *name)
 {
-	return mowgli_patricia_retrieve(servers_by_name, name);
+	return u_hash_get(&server_index, name);
 }
 
 struct capab_info {
@@ -194,6 +214,7 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 	sv = malloc(sizeof(*sv));
 
 	sv->link = parent->link;
+	sv->flags = 0;
 	if (sid)
 		u_strlcpy(sv->sid, sid, 4);
 	else
@@ -210,6 +231,7 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 	if (sv->sid[0])
 		mowgli_patricia_add(servers_by_sid, sv->sid, sv);
 	mowgli_patricia_add(servers_by_name, sv->name, sv);
+	u_hash_add(&server_index, &sv->name_ent, sv->name, sv);
 
 	u_log(LG_INFO, "New remote server name=%s, sid=%s", sv->name, sv->sid);
 
@@ -218,46 +240,83 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 	return sv;
 }
 
-void u_server_destroy(u_server *sv)
+static void mark_splitting(u_server *sv)
 {
 	mowgli_patricia_iteration_state_t state;
-	u_user *u;
 	u_server *tsv;
 
-	if (sv == &me) {
-		u_log(LG_ERROR, "Can't unlink self!");
-		return;
+	sv->flags |= SERVER_IS_SPLITTING;
+
+	MOWGLI_PATRICIA_FOREACH(tsv, &state, servers_by_sid) {
+		if (tsv->parent == sv)
+			mark_splitting(tsv);
 	}
+}
+
+static void server_unlink(u_server *sv)
+{
+	mowgli_patricia_iteration_state_t state;
+	u_server *tsv;
 
 	u_log(LG_INFO, "Unlinking server sid=%s (%S)", sv->sid, sv);
 
 	sv->parent->nlinks--;
 
-	/* delete all users */
-	if (sv->sid[0]) {
-		MOWGLI_PATRICIA_FOREACH(u, &state, users_by_uid) {
-			if (strncmp(sv->sid, u->uid, 3))
-				continue;
-
-			u_sendto_visible(u, ST_USERS, ":%H QUIT :*.net *.split", u);
-			u_user_destroy(u);
-		}
-	}
-
-	if (sv->name[0])
+	if (sv->name[0]) {
 		mowgli_patricia_delete(servers_by_name, sv->name);
+		u_hash_del(&server_index, &sv->name_ent);
+	}
 	if (sv->sid[0])
 		mowgli_patricia_delete(servers_by_sid, sv->sid);
 
 	/* delete any servers linked to this one */
 	MOWGLI_PATRICIA_FOREACH(tsv, &state, servers_by_sid) {
 		if (tsv->parent == sv)
-			u_server_destroy(tsv);
+			server_unlink(tsv);
 	}
 
 	free(sv);
 }
 
+/* Everything behind sv goes at once. The lost users are found in one
+   pass over all users rather than one per server, and their QUITs go
+   out through u_sendto_split, so each local user gets all of theirs in
+   one write instead of having a visible fan-out run per lost user. */
+void u_server_destroy(u_server *sv)
+{
+	mowgli_patricia_iteration_state_t state;
+	u_user *u, **lost;
+	int i, nlost = 0, alloc = 64;
+
+	if (sv == &me) {
+		u_log(LG_ERROR, "Can't unlink self!");
+		return;
+	}
+
+	mark_splitting(sv);
+
+	lost = malloc(alloc * sizeof(*lost));
+
+	MOWGLI_PATRICIA_FOREACH(u, &state, users_by_uid) {
+		if (!(u->sv->flags & SERVER_IS_SPLITTING))
+			continue;
+
+		if (nlost == alloc)
+			lost = realloc(lost, (alloc *= 2) * sizeof(*lost));
+		lost[nlost++] = u;
+	}
+
+	u_log(LG_INFO, "Netsplit of %S loses %d users", sv, nlost);
+
+	u_sendto_split(lost, nlost, "*.net *.split");
+
+	for (i=0; i<nlost; i++)
+		u_user_destroy(lost[i]);
+	free(lost);
+
+	server_unlink(sv);
+}
+
 static int burst_euid(const char *key, void *value, void *priv)
 {
 	u_user *u = value;
@@ -304,13 +363,11 @@ static int burst_chan(const char *key, void *_c, void *_link)
 {
 	u_chan *c = _c;
 	u_link *link = _link;
-	u_user *u;
 	u_chanuser *cu;
-	u_map_each_state st;
 	u_strop_wrap wrap;
 	mowgli_node_t *n;
 	char *s, buf[512];
-	int sz;
+	int sz, i;
 
 	if (c->flags & CHAN_LOCAL)
 		return 0;
@@ -319,7 +376,7 @@ static int burst_chan(const char *key, void *_c, void *_link)
 	         &me, c->ts, c->name, u_chan_modes(c, 1));
 
 	u_strop_wrap_start(&wrap, 510 - sz);
-	U_MAP_EACH(&st, c->members, &u, &cu) {
+	U_CHAN_EACH_MEMBER(c, i, cu) {
 		char *p, nbuf[12];
 
 		p = nbuf;
@@ -328,7 +385,7 @@ static int burst_chan(const char *key, void *_c, void *_link)
 			if (cu->flags & cs->mask)
 				*p++ = cs->prefix;
 		}
-		strcpy(p, u->uid);
+		strcpy(p, cu->u->uid);
 
 		while ((s = u_strop_wrap_word(&wrap, nbuf)) != NULL)
 			u_link_f(link, "%s%s", buf, s);
@@ -410,6 +467,7 @@ void u_server_burst_2(u_server *sv, u_link_block *block)
 
 	u_log(LG_DEBUG, "Adding %s to servers_by_name", sv->name);
 	mowgli_patricia_add(servers_by_name, sv->name, sv);
+	u_hash_add(&server_index, &sv->name_ent, sv->name, sv);
 }
 
 void u_server_eob(u_server *sv)
@@ -563,6 +621,7 @@ static int restore_specific_server(const char *sid, mowgli_json_t *js)
 
 		mowgli_patricia_add(servers_by_sid,  s->sid,  s);
 		mowgli_patricia_add(servers_by_name, s->name, s);
+		u_hash_add(&server_index, &s->name_ent, s->name, s);
 	}
 
 	return 1;
@@ -606,6 +665,7 @@ int init_server(void)
 {
 	servers_by_sid = mowgli_patricia_create(ascii_canonize);
 	servers_by_name = mowgli_patricia_create(ascii_canonize);
+	u_hash_init(&server_index, ascii_casemap);
 
 	mowgli_list_init(&my_motd);
 
@@ -629,7 +689,10 @@ int init_server(void)
 	me.nusers = 0;
 	me.nlinks = 0;
 
+	render_prefixes();
+
 	mowgli_patricia_add(servers_by_name, me.name, &me);
+	u_hash_add(&server_index, &me.name_ent, me.name, &me);
 	mowgli_patricia_add(servers_by_sid, me.sid, &me);
 
 	return 1;
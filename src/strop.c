@@ -6,6 +6,11 @@
 
 #include "ircd.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HAVE_SSE2_EOL
+#endif
+
 void u_strop_split_start(u_strop_state *st, char *s, char *delim)
 {
 	st->s = s;
@@ -71,3 +76,67 @@ char *u_strop_wrap_word(u_strop_wrap *w, char *word)
 
 	return NULL;
 }
+
+/* Finding line endings is on the hot path for every byte received, so
+   rather than two memchr calls this looks for both \r and \n in a
+   single pass, 16 bytes at a time with SSE2 or a word at a time
+   otherwise. */
+
+#ifdef HAVE_SSE2_EOL
+uchar *u_memeol(const uchar *buf, size_t len)
+{
+	const uchar *s = buf, *e = buf + len;
+	__m128i cr = _mm_set1_epi8('\r');
+	__m128i lf = _mm_set1_epi8('\n');
+	__m128i v, w;
+	uint mask;
+
+	for (; e - s >= 32; s += 32) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		w = _mm_loadu_si128((const __m128i*)(s + 16));
+		v = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf));
+		w = _mm_or_si128(_mm_cmpeq_epi8(w, cr), _mm_cmpeq_epi8(w, lf));
+		mask = _mm_movemask_epi8(v) | (_mm_movemask_epi8(w) << 16);
+		if (mask)
+			return (uchar*)s + __builtin_ctz(mask);
+	}
+
+	for (; e - s >= 16; s += 16) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+		                                      _mm_cmpeq_epi8(v, lf)));
+		if (mask)
+			return (uchar*)s + __builtin_ctz(mask);
+	}
+
+	for (; s < e; s++) {
+		if (*s == '\r' || *s == '\n')
+			return (uchar*)s;
+	}
+
+	return NULL;
+}
+#else
+#define ONES    (((ulong)-1) / 0xff)  /* 0x0101...01 */
+#define HIGHS   (ONES << 7)           /* 0x8080...80 */
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+
+uchar *u_memeol(const uchar *buf, size_t len)
+{
+	const uchar *s = buf, *e = buf + len;
+	ulong w, cr = ONES * '\r', lf = ONES * '\n';
+
+	for (; e - s >= sizeof(w); s += sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		if (HAS_ZERO(w ^ cr) || HAS_ZERO(w ^ lf))
+			break;
+	}
+
+	for (; s < e; s++) {
+		if (*s == '\r' || *s == '\n')
+			return (uchar*)s;
+	}
+
+	return NULL;
+}
+#endif
@@ -84,6 +84,10 @@ begin_upgrade(void)
 	if (!f)
 		return -1;
 
+	/* Connections on I/O threads are handed over like any other, so
+	   the threads must leave their sockets alone from here on */
+	u_io_pause();
+
 	/* Open database */
 	upgrade_json = mowgli_json_create_object();
 
@@ -96,6 +100,7 @@ begin_upgrade(void)
 	h_dump = u_hook_get(HOOK_UPGRADE_DUMP);
 	if (u_hook_first(h_dump, NULL)) {
 		/* return non-NULL to abort */
+		u_io_resume();
 		return -1;
 	}
 
@@ -114,9 +119,10 @@ begin_upgrade(void)
 	if ((err = _form_phoenix_args(UPGRADE_FILENAME, &argv)) < 0)
 		goto error;
 
-	return execvp(argv[0], (char**)argv);
+	err = execvp(argv[0], (char**)argv);
 
 error:
+	u_io_resume();
 	if (upgrade_json) {
 		mowgli_json_decref(upgrade_json);
 		upgrade_json = NULL;
@@ -6,7 +6,7 @@
 
 #include "ircd.h"
 
-mowgli_patricia_t *users_by_nick;
+u_hash nick_index;
 mowgli_patricia_t *users_by_uid;
 
 char *id_map = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
@@ -91,8 +91,9 @@ static u_user *create_user(const char *uid, u_link *link, u_server *sv)
 	u_strlcpy(u->uid, uid, 10);
 	mowgli_patricia_add(users_by_uid, u->uid, u);
 
-	u->channels = u_map_new(0);
-	u->invites = u_map_new(0);
+	u->channels = NULL;
+	u->nchannels = u->channels_alloc = 0;
+	u->invites = u_map_new(MAP_HASHED);
 
 	u_ratelimit_init(u);
 
@@ -142,11 +143,6 @@ u_user *u_user_create_remote(u_server *sv, char *uid)
 	return u;
 }
 
-void user_destroy_cb(u_map *map, u_chan *c, u_chanuser *cu, void *priv)
-{
-	u_chan_user_del(cu);
-}
-
 void u_user_destroy(u_user *u)
 {
 	u_log(LG_VERBOSE, "Destroying user uid=%s (%U)", u->uid, u);
@@ -154,11 +150,12 @@ void u_user_destroy(u_user *u)
 	u_clr_invites_user(u);
 
 	/* part from all channels */
-	u_map_each(u->channels, (u_map_cb_t*)user_destroy_cb, NULL);
-	u_map_free(u->channels);
+	while (u->nchannels > 0)
+		u_chan_user_del(u->channels[u->nchannels - 1]);
+	free(u->channels);
 
 	if (u->nick[0])
-		mowgli_patricia_delete(users_by_nick, u->nick);
+		u_hash_del(&nick_index, &u->nick_ent);
 	mowgli_patricia_delete(users_by_uid, u->uid);
 
 	u->sv->nusers--;
@@ -192,13 +189,13 @@ void u_user_try_register(u_user *u)
 	u->link->flags |= U_LINK_REGISTERED;
 	u_strlcpy(u->ip, u->link->conn->ip, INET6_ADDRSTRLEN);
 	u_strlcpy(u->realhost, u->link->conn->host, MAXHOST+1);
-	u_strlcpy(u->host, u->link->conn->host, MAXHOST+1);
+	u_user_set_host(u, u->link->conn->host);
 	u_user_welcome(u);
 }
 
 u_user *u_user_by_nick_raw(const char *nick)
 {
-	return mowgli_patricia_retrieve(users_by_nick, nick);
+	return u_hash_get(&nick_index, nick);
 }
 
 u_user *u_user_by_nick(const char *nick)
@@ -247,10 +244,23 @@ void u_user_set_nick(u_user *u, char *nick, uint ts)
 {
 	/* TODO: check collision? */
 	if (u->nick[0])
-		mowgli_patricia_delete(users_by_nick, u->nick);
+		u_hash_del(&nick_index, &u->nick_ent);
 	u_strlcpy(u->nick, nick, MAXNICKLEN+1);
-	mowgli_patricia_add(users_by_nick, u->nick, u);
+	u_hash_add(&nick_index, &u->nick_ent, u->nick, u);
 	u->nickts = ts;
+	u_user_mask_changed(u);
+}
+
+void u_user_set_ident(u_user *u, char *ident)
+{
+	u_strlcpy(u->ident, ident, MAXIDENT+1);
+	u_user_mask_changed(u);
+}
+
+void u_user_set_host(u_user *u, char *host)
+{
+	u_strlcpy(u->host, host, MAXHOST+1);
+	u_user_mask_changed(u);
 }
 
 bool u_user_try_override(u_user *u)
@@ -262,8 +272,9 @@ bool u_user_try_override(u_user *u)
 		return false;
 
 	u_user_num(u, ERR_NICKNAMEINUSE, u->nick);
-	mowgli_patricia_delete(users_by_nick, u->nick);
+	u_hash_del(&nick_index, &u->nick_ent);
 	u->nick[0] = '\0';
+	u_user_mask_changed(u);
 
 	return true;
 }
@@ -317,7 +328,132 @@ struct isupport {
 	{ NULL },
 };
 
-void u_user_send_isupport(u_user *u)
+/* Reply caches */
+/* ------------- */
+
+/* ISUPPORT and the MOTD are the same for every local client apart from
+   the target, and go out to every client that connects. They're
+   rendered once into a reply cache with the target left out of each
+   line, so sending them is a few memcpys into the sendq. Caches are
+   dropped by u_user_reply_cache_clear and rebuilt on next use. */
+
+struct reply_line {
+	ushort pre, post; /* text before and after the target */
+};
+
+struct reply_cache {
+	bool valid;
+	char *data;
+	size_t size, alloc;
+	struct reply_line *lines;
+	int nlines, lines_alloc;
+};
+
+static struct reply_cache isupport_cache;
+static struct reply_cache motd_cache;
+
+static void cache_reset(struct reply_cache *rc)
+{
+	rc->valid = false;
+	rc->size = 0;
+	rc->nlines = 0;
+}
+
+static void cache_add(struct reply_cache *rc, int num, ...)
+{
+	char buf[512];
+	struct reply_line *line;
+	size_t pre, post;
+	va_list va;
+
+	memcpy(buf, me_prefix_user.s, me_prefix_user.len);
+	pre = me_prefix_user.len;
+	buf[pre++] = '0' + num / 100 % 10;
+	buf[pre++] = '0' + num / 10 % 10;
+	buf[pre++] = '0' + num % 10;
+	buf[pre++] = ' ';
+
+	/* leave room for the longest target */
+	post = 0;
+	buf[pre + post++] = ' ';
+	va_start(va, num);
+	post += vsnf(FMT_USER, buf + pre + post, 510 - MAXNICKLEN - pre - post,
+	             u_numeric_fmt[num], va);
+	va_end(va);
+	buf[pre + post++] = '\r';
+	buf[pre + post++] = '\n';
+
+	if (rc->size + pre + post > rc->alloc) {
+		rc->alloc = rc->alloc ? rc->alloc * 2 : 4096;
+		rc->data = realloc(rc->data, rc->alloc);
+	}
+	if (rc->nlines == rc->lines_alloc) {
+		rc->lines_alloc = rc->lines_alloc ? rc->lines_alloc * 2 : 32;
+		rc->lines = realloc(rc->lines,
+		                    rc->lines_alloc * sizeof(*rc->lines));
+	}
+
+	memcpy(rc->data + rc->size, buf, pre + post);
+	rc->size += pre + post;
+
+	line = &rc->lines[rc->nlines++];
+	line->pre = pre;
+	line->post = post;
+}
+
+static void cache_send(struct reply_cache *rc, u_user *u)
+{
+	char *tgt, *src = rc->data;
+	size_t tlen, sz;
+	uchar *buf, *p;
+	int i, j;
+
+	tgt = IS_REGISTERED(u) ? u->nick : "*";
+	tlen = strlen(tgt);
+
+	for (i=0; i<rc->nlines; i=j) {
+		sz = 0;
+		for (j=i; j<rc->nlines; j++) {
+			size_t len = rc->lines[j].pre + tlen + rc->lines[j].post;
+			if (sz + len > SENDQ_CHUNK_MAX)
+				break;
+			sz += len;
+		}
+
+		if ((buf = u_link_get_buffer(u->link, sz)) == NULL)
+			return;
+
+		for (p=buf; i<j; i++) {
+			memcpy(p, src, rc->lines[i].pre);
+			p += rc->lines[i].pre;
+			src += rc->lines[i].pre;
+			memcpy(p, tgt, tlen);
+			p += tlen;
+			memcpy(p, src, rc->lines[i].post);
+			p += rc->lines[i].post;
+			src += rc->lines[i].post;
+		}
+
+		u_link_end_buffer(u->link, sz);
+	}
+
+	u_log(LG_DEBUG, "[%G] <- %d cached lines", u->link, rc->nlines);
+}
+
+void u_user_reply_cache_clear(void)
+{
+	cache_reset(&isupport_cache);
+	cache_reset(&motd_cache);
+}
+
+static void *on_conf_end(void *unused, void *unused2)
+{
+	u_user_reply_cache_clear();
+	return NULL;
+}
+
+/* calls cb with each line's worth of ISUPPORT tokens */
+static void isupport_each(void (*cb)(char*, void*), void *priv, int nicklen)
 {
 	/* :host.irc 005 nick ... :are supported by this server
 	   *        *****    *   *....*....*....*....*....*.... = 37 */
@@ -326,7 +462,7 @@ void u_user_send_isupport(u_user *u)
 	char *s, *p, tmp[512];
 	mowgli_node_t *n;
 
-	u_strop_wrap_start(&wrap, 510 - 37 - strlen(me.name) - strlen(u->nick));
+	u_strop_wrap_start(&wrap, 510 - 37 - strlen(me.name) - nicklen);
 
 	for (cur=isupport; cur->name; cur++) {
 		p = tmp;
@@ -352,10 +488,35 @@ void u_user_send_isupport(u_user *u)
 		}
 
 		while ((s = u_strop_wrap_word(&wrap, p)) != NULL)
-			u_user_num(u, RPL_ISUPPORT, s);
+			cb(s, priv);
 	}
 	if ((s = u_strop_wrap_word(&wrap, NULL)) != NULL)
-		u_user_num(u, RPL_ISUPPORT, s);
+		cb(s, priv);
+}
+
+static void isupport_cache_line(char *s, void *rc)
+{
+	cache_add(rc, RPL_ISUPPORT, s);
+}
+
+static void isupport_num(char *s, void *u)
+{
+	u_user_num(u, RPL_ISUPPORT, s);
+}
+
+void u_user_send_isupport(u_user *u)
+{
+	if (!IS_LOCAL_USER(u)) {
+		isupport_each(isupport_num, u, strlen(u->nick));
+		return;
+	}
+
+	if (!isupport_cache.valid) {
+		isupport_each(isupport_cache_line, &isupport_cache, MAXNICKLEN);
+		isupport_cache.valid = true;
+	}
+
+	cache_send(&isupport_cache, u);
 }
 
 void u_user_send_motd(u_user *u)
@@ -367,6 +528,19 @@ void u_user_send_motd(u_user *u)
 		return;
 	}
 
+	if (IS_LOCAL_USER(u)) {
+		if (!motd_cache.valid) {
+			cache_add(&motd_cache, RPL_MOTDSTART, me.name);
+			MOWGLI_LIST_FOREACH(n, my_motd.head)
+				cache_add(&motd_cache, RPL_MOTD, n->data);
+			cache_add(&motd_cache, RPL_ENDOFMOTD);
+			motd_cache.valid = true;
+		}
+
+		cache_send(&motd_cache, u);
+		return;
+	}
+
 	u_user_num(u, RPL_MOTDSTART, me.name);
 	MOWGLI_LIST_FOREACH(n, my_motd.head)
 		u_user_num(u, RPL_MOTD, n->data);
@@ -409,9 +583,7 @@ static int is_in_list(char *host, mowgli_list_t *list)
 
 int u_user_in_list(u_user *u, mowgli_list_t *list)
 {
-	char buf[512];
-	snf(FMT_USER, buf, 512, "%H", u);
-	return is_in_list(buf, list);
+	return is_in_list(u_user_mask(u), list);
 }
 
 void u_user_make_euid(u_user *u, char *buf)
@@ -578,6 +750,8 @@ static int restore_specific_user(const char *uid, mowgli_json_t *ju)
 		return -1;
 	memcpy(u->away,     jsaway->str,     jsaway->pos);
 
+	u_user_mask_changed(u);
+
 	jlimit = json_ogeto(ju, "limit");
 	if (!jlimit)
 		return -1;
@@ -610,7 +784,7 @@ static int restore_specific_user(const char *uid, mowgli_json_t *ju)
 		u->link = sv_via->link;
 	}
 
-	mowgli_patricia_add(users_by_nick, u->nick, u);
+	u_hash_add(&nick_index, &u->nick_ent, u->nick, u);
 
 	return 0;
 }
@@ -656,12 +830,14 @@ int restore_user(void)
  */
 int init_user(void)
 {
-	users_by_nick = mowgli_patricia_create(rfc1459_canonize);
+	u_hash_init(&nick_index, rfc1459_casemap);
 	users_by_uid = mowgli_patricia_create(ascii_canonize);
 
-	if (!users_by_nick || !users_by_uid)
+	if (!users_by_uid)
 		return -1;
 
+	u_hook_add(HOOK_CONF_END, on_conf_end, NULL);
+
 	return 0;
 }
 
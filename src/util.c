@@ -165,8 +165,8 @@ unsigned long parse_size(char *s)
 
 static uint ctype_map[256];
 static char null_casemap[256];
-static char rfc1459_casemap[256];
-static char ascii_casemap[256];
+char rfc1459_casemap[256];
+char ascii_casemap[256];
 
 int matchmap(char *mask, char *string, char *casemap)
 {
@@ -490,6 +490,19 @@ int set_cloexec(int fd)
 	return 0;
 }
 
+int set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+
+	if (fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0)
+		return -1;
+
+	return 0;
+}
+
 /* Base64 Encoder
  * --------------
  */
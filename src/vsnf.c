@@ -51,6 +51,17 @@ static void string(struct buffer *buf, char *s, int copylen, struct spec *spec)
 	buf->len += copylen;
 }
 
+/* string() without the width handling, for format text */
+static void literal(struct buffer *buf, const char *s, uint len)
+{
+	if (len > buf->size - buf->len)
+		len = buf->size - buf->len;
+
+	memcpy(buf->p, s, len);
+	buf->p += len;
+	buf->len += len;
+}
+
 static void character(struct buffer *buf, char c)
 {
 	if (buf->len >= buf->size)
@@ -89,134 +100,78 @@ static void integer(struct buffer *buf, uint n, uint sign, uint base,
 	string(buf, s, buf2 + 63 - s, spec);
 }
 
-int vsnf(int type, char *s, uint size, const char *fmt, va_list va)
+/* a single conversion. spec has already been parsed. returns false if
+   conv isn't a known conversion */
+static bool conversion(struct buffer *buf, int type, int debug, char conv,
+                       struct spec *spec, va_list *va)
 {
-	char *p, specbuf[16];
 	char c_arg, *s_arg, *q;
 	u_user *user;
 	u_chan *chan;
 	u_server *server;
 	u_link *link;
 	u_sourceinfo *si;
-
-	struct buffer buf;
-	struct spec spec;
-	int base, debug = 0;
+	int base = 0;
 	uint n;
 
-	if (type == FMT_DEBUG) {
-		debug = 1;
-		type = FMT_LOG;
-	}
-
-#ifdef VSNF_LOG
-	if (type != FMT_LOG)
-		u_log(LG_FINE, "vsnf(%s, %s)",
-		      type == FMT_USER ? "USER" : "SERVER", fmt);
-#endif
-
-	buf.p = buf.base = s;
-	buf.size = size - 1; /* null byte */
-	buf.len = 0;
-
-	/* silly little optimization */
-	if (streq(fmt, "%s")) {
-		s_arg = va_arg(va, char*);
-		u_strlcpy(s, s_arg, size);
-		return strlen(s);
-	}
-
-	/* a goto is used to reduce indentation */
-top:
-	if (!*fmt)
-		goto bottom;
-
-	if (*fmt != '%') {
-		character(&buf, *fmt++);
-		goto top;
-	}
-
-	fmt++;
-
-	base = 0;
-	spec.width = 0;
-	spec.pad = ' ';
-
-	p = specbuf;
-	while (isdigit(*fmt))
-		*p++ = *fmt++;
-	*p = '\0';
-
-	p = specbuf;
-	if (*p) {
-		if (*p == '0') {
-			spec.pad = '0';
-			p++;
-		}
-		spec.width = atoi(p);
-	}
-
-	switch (*fmt) {
+	switch (conv) {
 	/* useful IRC formats */
 	case 'U': /* user */
-		user = va_arg(va, u_user*);
+		user = va_arg(*va, u_user*);
 		if (type == FMT_SERVER) {
 			q = user ? user->uid : "*"; /* XXX: ?????? */
-			string(&buf, q, 9, NULL);
+			string(buf, q, 9, NULL);
 		} else {
 			q = (user && user->nick[0]) ? user->nick : "*";
-			string(&buf, q, -1, &spec);
+			string(buf, q, -1, spec);
 			if (debug) {
-				integer(&buf, (size_t)user, 0, 16, NULL);
-				character(&buf, ']');
+				integer(buf, (size_t)user, 0, 16, NULL);
+				character(buf, ']');
 			}
 		}
 		break;
 
 	case 'H': /* hostmask */
-		user = va_arg(va, u_user*);
+		user = va_arg(*va, u_user*);
 		if (type == FMT_SERVER) {
-			string(&buf, user->uid, 9, NULL);
+			string(buf, user->uid, 9, NULL);
 		} else {
-			string(&buf, user->nick, -1, NULL);
-			character(&buf, '!');
-			string(&buf, user->ident, -1, NULL);
-			character(&buf, '@');
-			string(&buf, user->host, -1, NULL);
+			q = u_user_mask(user);
+			string(buf, q, user->masklen, NULL);
 			if (debug) {
-				character(&buf, '[');
-				integer(&buf, (size_t)user, 0, 16, NULL);
-				character(&buf, ']');
+				character(buf, '[');
+				integer(buf, (size_t)user, 0, 16, NULL);
+				character(buf, ']');
 			}
 		}
 		break;
 
 	case 'C': /* channel */
-		chan = va_arg(va, u_chan*);
-		string(&buf, chan?chan->name:"*", -1, &spec);
+		chan = va_arg(*va, u_chan*);
+		string(buf, chan?chan->name:"*", -1, spec);
 		if (debug) {
-			character(&buf, '[');
-			integer(&buf, (size_t)chan, 0, 16, NULL);
-			character(&buf, ']');
+			character(buf, '[');
+			integer(buf, (size_t)chan, 0, 16, NULL);
+			character(buf, ']');
 		}
 		break;
 
 	case 'S': /* server */
-		server = va_arg(va, u_server*);
+		server = va_arg(*va, u_server*);
 		if (type == FMT_SERVER) {
-			string(&buf, server->sid, 3, NULL);
+			string(buf, server->sid, 3, NULL);
 		} else {
-			string(&buf, server->name, -1, &spec);
+			string(buf, server->name, -1, spec);
 			if (debug) {
-				character(&buf, '[');
-				integer(&buf, (size_t)server, 0, 16, NULL);
-				character(&buf, ']');
+				character(buf, '[');
+				integer(buf, (size_t)server, 0, 16, NULL);
+				character(buf, ']');
 			}
 		}
 		break;
 
 	case 'G': /* generic link */
-		link = va_arg(va, u_link*);
+		link = va_arg(*va, u_link*);
 
 		switch ((link && link->priv) ? link->type : -1) {
 		case LINK_USER:
@@ -233,32 +188,29 @@ top:
 			s_arg = "*";
 		}
 
-		string(&buf, (s_arg && s_arg[0]) ? s_arg : "*", -1, &spec);
+		string(buf, (s_arg && s_arg[0]) ? s_arg : "*", -1, spec);
 		break;
 
 	case 'I': /* sourceinfo */
-		si = va_arg(va, u_sourceinfo*);
+		si = va_arg(*va, u_sourceinfo*);
 		if (type == FMT_SERVER) {
-			string(&buf, (char*)si->id, si->u ? 9 : 3, NULL);
+			string(buf, (char*)si->id, si->u ? 9 : 3, NULL);
 		} else {
 			if (si->u) {
-				string(&buf, si->u->nick, -1, NULL);
-				character(&buf, '!');
-				string(&buf, si->u->ident, -1, NULL);
-				character(&buf, '@');
-				string(&buf, si->u->host, -1, NULL);
+				q = u_user_mask(si->u);
+				string(buf, q, si->u->masklen, NULL);
 			} else if (si->s) {
-				string(&buf, si->s->name, -1, &spec);
+				string(buf, si->s->name, -1, spec);
 			} else {
-				string(&buf, "?", 1, NULL);
+				string(buf, "?", 1, NULL);
 			}
 		}
 		break;
 
 	/* standard printf-family formats */
 	case 's':
-		s_arg = va_arg(va, char*);
-		string(&buf, s_arg, -1, &spec);
+		s_arg = va_arg(*va, char*);
+		string(buf, s_arg, -1, spec);
 		break;
 
 	case 'd':
@@ -267,35 +219,284 @@ top:
 	case 'o':
 	case 'x':
 	case 'p':
-		n = va_arg(va, uint);
+		n = va_arg(*va, uint);
 		if (base == 0) /* eww, further hax */
-			base = (*fmt == 'o') ? 8 : 16;
+			base = (conv == 'o') ? 8 : 16;
 
-		if (*fmt == 'p') {
+		if (conv == 'p') {
 			/* this is non-conforming :( */
-			spec.width = 8;
-			spec.pad = '0';
-			string(&buf, "0x", 2, NULL);
+			spec->width = 8;
+			spec->pad = '0';
+			string(buf, "0x", 2, NULL);
 		}
 
-		integer(&buf, n, *fmt == 'd', base, &spec);
+		integer(buf, n, conv == 'd', base, spec);
 		break;
 
 	case 'c':
-		c_arg = va_arg(va, int);
-		character(&buf, c_arg);
+		c_arg = va_arg(*va, int);
+		character(buf, c_arg);
+		break;
+
+	case '%':
+		character(buf, '%');
 		break;
 
 	default:
+		return false;
+	}
+
+	return true;
+}
+
+/* parses the width and padding between % and the conversion letter.
+   returns a pointer to the conversion letter */
+static const char *parse_spec(const char *fmt, struct spec *spec)
+{
+	spec->width = 0;
+	spec->pad = ' ';
+
+	if (*fmt == '0') {
+		spec->pad = '0';
+		fmt++;
+	}
+
+	/* the specbuf this replaced held 15 digits, and atoi of anything
+	   that long was garbage anyway */
+	while (isdigit(*fmt))
+		spec->width = spec->width * 10 + (*fmt++ - '0');
+
+	return fmt;
+}
+
+static int interpret(int type, struct buffer *buf, const char *fmt,
+                     va_list *va)
+{
+	struct spec spec;
+	int debug = 0;
+
+	if (type == FMT_DEBUG) {
+		debug = 1;
+		type = FMT_LOG;
+	}
+
+	/* a goto is used to reduce indentation */
+top:
+	if (!*fmt)
+		return buf->len;
+
+	if (*fmt != '%') {
+		character(buf, *fmt++);
+		goto top;
+	}
+
+	fmt = parse_spec(fmt + 1, &spec);
+
+	if (!*fmt)
+		return buf->len;
+
+	if (!conversion(buf, type, debug, *fmt, &spec, va)) {
 		/* print a warning? */
-		character(&buf, '%');
-	case '%':
-		character(&buf, *fmt);
+		character(buf, '%');
+		character(buf, *fmt);
 	}
 
 	fmt++;
 	goto top;
-bottom:
+}
+
+/* Compiled formats */
+/* ---------------- */
+
+/* USER and SERVER formats are string constants, and the same few run
+   over and over. Each one is compiled once into a list of ops, runs of
+   literal text become a single memcpy and width specs are parsed ahead
+   of time, and the result is cached by format pointer and type. Nothing
+   checks the contents on a hit, so a format built at runtime must be
+   passed as an argument to "%s" instead. Formats in a module go away
+   when it is unloaded, and module_unload() calls vsnf_flush() before
+   that happens so the addresses can be reused. */
+
+#define OP_LITERAL 0
+#define OP_CONV    1
+
+struct op {
+	uchar kind;
+	char conv;
+	struct spec spec;
+	ushort off, len; /* OP_LITERAL, into prog->key */
+};
+
+struct prog {
+	const char *key;
+	int type;
+	struct prog *next;
+	int nops;
+	struct op ops[];
+};
+
+#define PROG_BUCKETS 1024
+#define PROG_MAX 4096
+
+static struct prog *progs[PROG_BUCKETS];
+static int nprogs = 0;
+
+bool vsnf_compiled = true;
+
+static uint prog_hash(const char *key, int type)
+{
+	ulong h = (ulong)key;
+	return ((h >> 3) ^ (h >> 13) ^ type) % PROG_BUCKETS;
+}
+
+static struct prog *compile(const char *key, int type)
+{
+	struct prog *prog;
+	const char *f, *lit;
+	struct op *op;
+	size_t len;
+	int nops = 0;
+
+	len = strlen(key);
+	if (len > 0xffff)
+		return NULL;
+
+	/* at most one op per character */
+	prog = malloc(sizeof(*prog) + (len + 1) * sizeof(struct op));
+	prog->key = key;
+	prog->type = type;
+
+	f = key;
+	while (*f) {
+		if (*f != '%') {
+			lit = f;
+			while (*f && *f != '%')
+				f++;
+			op = &prog->ops[nops++];
+			op->kind = OP_LITERAL;
+			op->off = lit - key;
+			op->len = f - lit;
+			continue;
+		}
+
+		op = &prog->ops[nops++];
+		f = parse_spec(f + 1, &op->spec);
+		if (!*f) {
+			nops--;
+			break;
+		}
+
+		op->kind = OP_CONV;
+		op->conv = *f++;
+	}
+
+	prog->nops = nops;
+	return prog;
+}
+
+void vsnf_flush(void)
+{
+	struct prog *prog, *next;
+	int i;
+
+	for (i=0; i<PROG_BUCKETS; i++) {
+		for (prog = progs[i]; prog; prog = next) {
+			next = prog->next;
+			free(prog);
+		}
+		progs[i] = NULL;
+	}
+
+	nprogs = 0;
+}
+
+static struct prog *lookup(const char *fmt, int type)
+{
+	struct prog **pp, *prog;
+
+	pp = &progs[prog_hash(fmt, type)];
+
+	for (prog = *pp; prog; prog = prog->next) {
+		if (prog->key == fmt && prog->type == type)
+			return prog;
+	}
+
+	/* only constants get here, so this takes a lot of distinct
+	   formats; start over rather than stop caching for good */
+	if (nprogs >= PROG_MAX) {
+		vsnf_flush();
+		pp = &progs[prog_hash(fmt, type)];
+	}
+
+	if ((prog = compile(fmt, type)) == NULL)
+		return NULL;
+
+	prog->next = *pp;
+	*pp = prog;
+	nprogs++;
+
+	return prog;
+}
+
+static int run(struct prog *prog, struct buffer *buf, va_list *va)
+{
+	struct op *op, *end = prog->ops + prog->nops;
+	struct spec spec;
+
+	for (op = prog->ops; op < end; op++) {
+		if (op->kind == OP_LITERAL) {
+			literal(buf, prog->key + op->off, op->len);
+			continue;
+		}
+
+		/* %p scribbles on its spec */
+		spec = op->spec;
+		if (!conversion(buf, prog->type, 0, op->conv, &spec, va)) {
+			character(buf, '%');
+			character(buf, op->conv);
+		}
+	}
+
+	return buf->len;
+}
+
+int vsnf(int type, char *s, uint size, const char *fmt, va_list va)
+{
+	struct buffer buf;
+	struct prog *prog = NULL;
+	va_list ap;
+	char *s_arg;
+
+#ifdef VSNF_LOG
+	if (type != FMT_LOG)
+		u_log(LG_FINE, "vsnf(%s, %s)",
+		      type == FMT_USER ? "USER" : "SERVER", fmt);
+#endif
+
+	buf.p = buf.base = s;
+	buf.size = size - 1; /* null byte */
+	buf.len = 0;
+
+	/* silly little optimization */
+	if (streq(fmt, "%s")) {
+		s_arg = va_arg(va, char*);
+		u_strlcpy(s, s_arg, size);
+		return strlen(s);
+	}
+
+	/* va is copied so a pointer to it can be handed around, which
+	   isn't portable for a va_list parameter */
+	va_copy(ap, va);
+
+	if (vsnf_compiled && (type == FMT_USER || type == FMT_SERVER))
+		prog = lookup(fmt, type);
+
+	if (prog != NULL)
+		run(prog, &buf, &ap);
+	else
+		interpret(type, &buf, fmt, &ap);
+
+	va_end(ap);
 
 	*(buf.p) = '\0';
 	return buf.len;
@@ -0,0 +1,165 @@
+/* ircd-micro, bench.c -- name lookup benchmark
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Looks up nicknames the way u_user_by_nick does, once through a
+   mowgli_patricia tree with an rfc1459 canonize callback, as users_by_nick
+   used to be, and once through a u_hash with the same casemap. Lookups
+   are written in whatever case the sender happened to use, and one in
+   four is for a nick nobody has, as with PRIVMSG to someone who just
+   quit. Both must find the same users. */
+
+#include "ircd.h"
+
+#define ROUNDS 4000000
+
+struct timeval NOW;
+
+struct buser {
+	char nick[MAXNICKLEN+1];
+	u_hash_ent nick_ent;
+};
+
+static char casemap[256];
+
+static char **lookups;
+static int nlookups;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the same table util.c builds */
+static void casemap_init(void)
+{
+	int i;
+
+	for (i=0; i<256; i++)
+		casemap[i] = islower(i) ? toupper(i) : i;
+
+	casemap['['] = '{';
+	casemap[']'] = '}';
+	casemap['\\'] = '|';
+	casemap['~'] = '^';
+}
+
+static void canonize(char *s)
+{
+	for (; *s; s++)
+		*s = casemap[(uchar)*s];
+}
+
+static void random_nick(char *s)
+{
+	static char *first = "abcdefghijklmnopqrstuvwxyz[]\\`_^{|}";
+	static char *rest = "abcdefghijklmnopqrstuvwxyz0123456789[]\\`_^{|}-";
+	int i, len = 4 + rand() % 9;
+
+	s[0] = first[rand() % strlen(first)];
+	for (i=1; i<len; i++)
+		s[i] = rest[rand() % strlen(rest)];
+	s[len] = '\0';
+}
+
+/* the same nick in a random mix of case, rfc1459 case included, so
+   []\ and {}| are swapped for each other too, and ^ may be written as
+   ~, which isn't valid in a nick but folds to ^ all the same */
+static void recase(char *s)
+{
+	static char *lower = "[]\\~", *upper = "{}|^";
+	char *p;
+
+	for (; *s; s++) {
+		if (!(rand() & 1))
+			continue;
+		if (islower(*s))
+			*s = toupper(*s);
+		else if (isupper(*s))
+			*s = tolower(*s);
+		else if ((p = strchr(lower, *s)) != NULL)
+			*s = upper[p - lower];
+		else if ((p = strchr(upper, *s)) != NULL)
+			*s = lower[p - upper];
+	}
+}
+
+static void run(int n)
+{
+	mowgli_patricia_t *tree;
+	u_hash hash;
+	struct buser *users;
+	ulong found_tree = 0, found_hash = 0;
+	double t_tree, t_hash;
+	int i;
+
+	tree = mowgli_patricia_create(canonize);
+	u_hash_init(&hash, casemap);
+	users = calloc(n, sizeof(*users));
+
+	for (i=0; i<n; i++) {
+		do {
+			random_nick(users[i].nick);
+		} while (u_hash_get(&hash, users[i].nick) != NULL);
+
+		mowgli_patricia_add(tree, users[i].nick, &users[i]);
+		u_hash_add(&hash, &users[i].nick_ent, users[i].nick, &users[i]);
+	}
+
+	nlookups = 4096;
+	lookups = malloc(nlookups * sizeof(*lookups));
+	for (i=0; i<nlookups; i++) {
+		lookups[i] = malloc(MAXNICKLEN+1);
+		if (i % 4 == 3) {
+			random_nick(lookups[i]);
+		} else {
+			strcpy(lookups[i], users[rand() % n].nick);
+			recase(lookups[i]);
+		}
+	}
+
+	for (i=0; i<nlookups; i++) {
+		if (mowgli_patricia_retrieve(tree, lookups[i])
+		    != u_hash_get(&hash, lookups[i]))
+			printf("!!! %s: tree and hash disagree\n", lookups[i]);
+	}
+
+	t_tree = now();
+	for (i=0; i<ROUNDS; i++)
+		found_tree += !!mowgli_patricia_retrieve(tree,
+		                          lookups[i & (nlookups - 1)]);
+	t_tree = now() - t_tree;
+
+	t_hash = now();
+	for (i=0; i<ROUNDS; i++)
+		found_hash += !!u_hash_get(&hash, lookups[i & (nlookups - 1)]);
+	t_hash = now() - t_hash;
+
+	printf("%7d nicks  patricia %6.1f ns  hash %6.1f ns  (%lu/%lu found)\n",
+	       n, t_tree * 1e9 / ROUNDS, t_hash * 1e9 / ROUNDS,
+	       found_tree, found_hash);
+
+	for (i=0; i<nlookups; i++)
+		free(lookups[i]);
+	free(lookups);
+	mowgli_patricia_destroy(tree, NULL, NULL);
+	free(hash.buckets);
+	free(users);
+}
+
+int main(int argc, char *argv[])
+{
+	gettimeofday(&NOW, NULL);
+	srand(1);
+	casemap_init();
+
+	run(100);
+	run(10000);
+	run(100000);
+
+	return 0;
+}
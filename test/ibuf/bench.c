@@ -0,0 +1,170 @@
+/* ircd-micro, bench.c -- input buffer benchmark
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Feeds a recorded burst (see genburst.py) through the line splitter,
+   once with the old fixed buffer, two memchr calls and a memmove per
+   read, and once with u_ibuf. Each read is capped at one TCP segment,
+   or in burst mode (-b) only by the space in the buffer, as when the
+   kernel already has a lot queued for a server link. */
+
+#include "ircd.h"
+
+#define SEGMENT 1448
+#define ROUNDS 20
+
+static uchar *trace;
+static size_t trace_len;
+static size_t segment = SEGMENT;
+static ulong reads;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static size_t feed(uchar *dst, size_t avail, size_t *pos)
+{
+	size_t sz = trace_len - *pos;
+
+	if (sz > segment)
+		sz = segment;
+	if (sz > avail)
+		sz = avail;
+
+	reads++;
+	memcpy(dst, trace + *pos, sz);
+	*pos += sz;
+	return sz;
+}
+
+/* the original dispatch_lines, minus the dispatch */
+static ulong run_legacy(size_t bufsize)
+{
+	uchar *ibuf = malloc(bufsize + 1);
+	size_t ibuflen = 0, pos = 0;
+	ulong lines = 0;
+
+	while (pos < trace_len) {
+		uchar *buf, *s, *p;
+		size_t buflen;
+
+		if (ibuflen == bufsize)
+			abort(); /* excess flood */
+
+		ibuflen += feed(ibuf + ibuflen, bufsize - ibuflen, &pos);
+
+		buf = ibuf;
+		buflen = ibuflen;
+		buf[buflen] = '\0';
+
+		while (buflen > 0) {
+			s = memchr(buf, '\r', buflen);
+			p = memchr(buf, '\n', buflen);
+			if (!s && !p)
+				break;
+			if (!s || (p && p < s))
+				s = p;
+			for (p = s; *p == '\r' || *p == '\n'; p++)
+				*p = '\0';
+			s = buf;
+			buf = p;
+			buflen = buflen - (p - s);
+			lines++;
+		}
+
+		memmove(ibuf, ibuf + ibuflen - buflen, buflen);
+		ibuflen = buflen;
+	}
+
+	free(ibuf);
+	return lines;
+}
+
+static ulong run_ibuf(size_t size, size_t max)
+{
+	u_ibuf ib;
+	size_t avail, pos = 0;
+	ulong lines = 0;
+	uchar *buf;
+
+	u_ibuf_init(&ib, size, max);
+
+	while (pos < trace_len) {
+		buf = u_ibuf_space(&ib, &avail);
+		if (avail == 0)
+			abort(); /* excess flood */
+
+		u_ibuf_commit(&ib, feed(buf, avail, &pos));
+
+		while (u_ibuf_line(&ib) != NULL)
+			lines++;
+	}
+
+	u_ibuf_free(&ib);
+	return lines;
+}
+
+static void report(const char *name, double t, ulong lines)
+{
+	printf("%-24s %8.2f ms/round  %6.1f MB/s  %lu lines  %lu reads\n",
+	       name, t * 1000 / ROUNDS, trace_len * ROUNDS / t / 1e6, lines,
+	       reads / ROUNDS);
+	reads = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	size_t alloc = 1 << 20;
+	ulong lines = 0;
+	double t;
+	int i;
+
+	if (argc > 1 && !strcmp(argv[1], "-b")) {
+		segment = (size_t)-1;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s [-b] burst.txt\n", argv[0]);
+		return 1;
+	}
+
+	if ((f = fopen(argv[1], "r")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	trace = malloc(alloc);
+	while (!feof(f)) {
+		if (trace_len == alloc)
+			trace = realloc(trace, alloc *= 2);
+		trace_len += fread(trace + trace_len, 1, alloc - trace_len, f);
+	}
+	fclose(f);
+
+	printf("%lu bytes, %d rounds\n", (ulong)trace_len, ROUNDS);
+
+	t = now();
+	for (i=0; i<ROUNDS; i++)
+		lines = run_legacy(IBUFSIZE);
+	report("legacy (2k, memchr x2)", now() - t, lines);
+
+	t = now();
+	for (i=0; i<ROUNDS; i++)
+		lines = run_ibuf(IBUFSIZE, IBUFSIZE);
+	report("u_ibuf (2k)", now() - t, lines);
+
+	t = now();
+	for (i=0; i<ROUNDS; i++)
+		lines = run_ibuf(IBUFSIZE, IBUFSIZE_SERVER);
+	report("u_ibuf (2k..64k)", now() - t, lines);
+
+	return 0;
+}
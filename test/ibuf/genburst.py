@@ -0,0 +1,62 @@
+#!/usr/bin/env python
+
+# generates something that looks like the burst a hub sends on link:
+# SID, EUID, AWAY, SJOIN and TB lines, with \r\n line endings
+
+import random
+import string
+import sys
+
+random.seed(1)
+
+NUSERS = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+NCHANS = NUSERS // 10
+
+def word(n):
+    return ''.join(random.choice(string.ascii_lowercase) for x in range(n))
+
+def out(s):
+    sys.stdout.write(s + '\r\n')
+
+out('PASS soup TS 6 :11A')
+out('CAPAB :QS EX CHW IE EOB KLN UNKLN KNOCK TB ENCAP SERVICES SAVE EUID')
+out('SERVER hub.example.net 1 :Example hub')
+out('SVINFO 6 6 0 :1400000000')
+
+sids = ['11A']
+for i in range(20):
+    sid = '%02dB' % i
+    out(':11A SID leaf%d.example.net 2 %s :Leaf %d' % (i, sid, i))
+    sids.append(sid)
+
+uids = []
+for i in range(NUSERS):
+    sid = random.choice(sids)
+    uid = '%s%06d' % (sid, i)
+    nick = word(random.randint(4, 12))
+    host = '%s.%s.example.com' % (word(6), word(4))
+    out(':%s EUID %s 2 %d +i %s %s 10.%d.%d.%d %s %s * :%s %s' % (
+        sid, nick, 1400000000 + i, word(8), host,
+        random.randint(0, 255), random.randint(0, 255),
+        random.randint(0, 255), uid, host, word(5), word(7)))
+    if random.random() < 0.05:
+        out(':%s AWAY :%s' % (uid, ' '.join(word(5) for x in range(6))))
+    uids.append(uid)
+
+for i in range(NCHANS):
+    name = '#' + word(random.randint(3, 15))
+    members = random.sample(uids, random.randint(1, 80))
+    head = ':11A SJOIN %d %s +nt :' % (1300000000 + i, name)
+    line = ''
+    for uid in members:
+        pfx = random.choice(['', '', '', '@', '+'])
+        if len(head) + len(line) + len(pfx) + len(uid) + 1 > 510:
+            out(head + line.strip())
+            line = ''
+        line += pfx + uid + ' '
+    out(head + line.strip())
+    if random.random() < 0.3:
+        out(':11A TB %s %d setter :%s' % (name, 1300000000 + i,
+            ' '.join(word(6) for x in range(8))))
+
+out(':11A PING hub.example.net :11A')
@@ -0,0 +1,120 @@
+/* ircd-micro, bench.c -- pointer map benchmark
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Times the operations membership does on its maps -- insert, lookup,
+   a full U_MAP_EACH walk, and delete -- on the AA tree and on the
+   MAP_HASHED table, at the sizes of a user's channel list, a busy
+   channel, and something much larger. Keys are separately allocated
+   structs, like the users and channels they stand in for, in shuffled
+   order. Small maps are repeated so every row covers about the same
+   number of operations. */
+
+#include "ircd.h"
+
+#define TOTAL_OPS 2000000
+
+struct timeval NOW;
+
+struct key {
+	char pad[64];
+};
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void shuffle(struct key **keys, int n)
+{
+	struct key *t;
+	int i, j;
+
+	for (i=n-1; i>0; i--) {
+		j = rand() % (i + 1);
+		t = keys[i];
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+}
+
+static void run(const char *name, int flags, struct key **keys, int n)
+{
+	double t_ins = 0, t_get = 0, t_each = 0, t_del = 0, t;
+	u_map_each_state st;
+	u_map *map;
+	ulong found = 0;
+	void *k;
+	int i, r, rounds;
+
+	rounds = TOTAL_OPS / n;
+	if (rounds < 1)
+		rounds = 1;
+
+	for (r=0; r<rounds; r++) {
+		map = u_map_new(flags);
+
+		t = now();
+		for (i=0; i<n; i++)
+			u_map_set(map, keys[i], keys[i]);
+		t_ins += now() - t;
+
+		t = now();
+		for (i=n-1; i>=0; i--)
+			found += u_map_get(map, keys[i]) != NULL;
+		t_get += now() - t;
+
+		t = now();
+		U_MAP_EACH(&st, map, &k, NULL)
+			found += k != NULL;
+		t_each += now() - t;
+
+		t = now();
+		for (i=0; i<n; i++)
+			u_map_del(map, keys[i]);
+		t_del += now() - t;
+
+		u_map_free(map);
+	}
+
+	if (found != (ulong)n * rounds * 2)
+		printf("!!! %lu entries found, expected %lu\n", found,
+		       (ulong)n * rounds * 2);
+
+#define NS(x) ((x) * 1e9 / ((double)n * rounds))
+	printf("%7d %-6s %8.1f %8.1f %8.1f %8.1f\n", n, name,
+	       NS(t_ins), NS(t_get), NS(t_each), NS(t_del));
+}
+
+int main(int argc, char *argv[])
+{
+	static int sizes[] = { 10, 1000, 100000 };
+	struct key **keys;
+	int i, s, n;
+
+	gettimeofday(&NOW, NULL);
+	srand(1);
+
+	printf("   size map      insert   lookup     each   delete  (ns/op)\n");
+
+	for (s=0; s<arraylen(sizes); s++) {
+		n = sizes[s];
+		keys = malloc(n * sizeof(*keys));
+		for (i=0; i<n; i++)
+			keys[i] = malloc(sizeof(**keys));
+		shuffle(keys, n);
+
+		run("tree", 0, keys, n);
+		run("hashed", MAP_HASHED, keys, n);
+
+		for (i=0; i<n; i++)
+			free(keys[i]);
+		free(keys);
+	}
+
+	return 0;
+}
@@ -1,12 +1,72 @@
 #include "ircd.h"
 
 #define LINESIZE 4096
+#define MAXLINES 65536
 
 u_map *map;
 
+/* With -h the map under test is MAP_HASHED. Its keys are pointers, so
+   each distinct key string is given one stable copy to stand for it,
+   and since a hashed map iterates in no particular order, the lines an
+   iteration prints are sorted before they go out. */
+bool hashed = false;
+u_map *names;
+
+char *lines[MAXLINES];
+int nlines = 0;
+
+static char *key(char *s)
+{
+	char *k;
+
+	if (!hashed)
+		return s;
+
+	if ((k = u_map_get(names, s)) == NULL) {
+		k = strdup(s);
+		u_map_set(names, s, k);
+	}
+
+	return k;
+}
+
+static void put(char *s)
+{
+	if (hashed && nlines < MAXLINES)
+		lines[nlines++] = strdup(s);
+	else
+		puts(s);
+}
+
+static int cmp_lines(const void *a, const void *b)
+{
+	return strcmp(*(char**)a, *(char**)b);
+}
+
+static void put_done(void)
+{
+	int i;
+
+	qsort(lines, nlines, sizeof(*lines), cmp_lines);
+	for (i=0; i<nlines; i++) {
+		puts(lines[i]);
+		free(lines[i]);
+	}
+
+	nlines = 0;
+}
+
+static void put_kv(char *k, char *v)
+{
+	char buf[LINESIZE * 2];
+
+	snprintf(buf, sizeof(buf), "%s=%s", k, v ? v : "(null)");
+	put(buf);
+}
+
 static void do_dump(u_map *map, void *k, void *v, void *priv)
 {
-	printf("%s=%s\n", k, v);
+	put_kv(k, v);
 }
 
 int main(int argc, char *argv[])
@@ -15,7 +75,13 @@ int main(int argc, char *argv[])
 	int running = 1;
 	size_t sz;
 
-	map = u_map_new(1);
+	if (argc > 1 && streq(argv[1], "-h")) {
+		hashed = true;
+		names = u_map_new(MAP_STRING_KEYS);
+		map = u_map_new(MAP_HASHED);
+	} else {
+		map = u_map_new(MAP_STRING_KEYS);
+	}
 
 	while (running && !feof(stdin)) {
 		fgets(line, LINESIZE, stdin);
@@ -36,6 +102,7 @@ int main(int argc, char *argv[])
 
 		case 'd': /* dump */
 			u_map_each(map, do_dump, NULL);
+			put_done();
 			break;
 
 		case 'D': { /* dump 2 */
@@ -43,8 +110,59 @@ int main(int argc, char *argv[])
 			char *k;
 			void *v;
 
-			U_MAP_EACH(&state, map, k, v)
-				printf("%s=%s\n", k, v);
+			U_MAP_EACH(&state, map, &k, &v)
+				put_kv(k, v);
+			put_done();
+			break;
+		}
+
+		case 'x': { /* delete everything while iterating */
+			u_map_each_state state;
+			char *k;
+
+			U_MAP_EACH(&state, map, &k, NULL) {
+				put(k);
+				free(u_map_del(map, k));
+			}
+			put_done();
+			break;
+		}
+
+		case 'f': { /* first key, leaving the iteration early */
+			u_map_each_state state;
+			char *k;
+
+			U_MAP_EACH(&state, map, &k, NULL) {
+				printf("%s\n", k);
+				break;
+			}
+			u_map_each_end(&state);
+			break;
+		}
+
+		case 'c': { /* change the map at every step of an iteration */
+			u_map_each_state state;
+			char *k;
+
+			U_MAP_EACH(&state, map, &k, NULL) {
+				put(k);
+				u_map_set(map, key("!"), strdup("!"));
+				free(u_map_del(map, key("!")));
+			}
+			put_done();
+			break;
+		}
+
+		case 'n': { /* nested iteration */
+			u_map_each_state st1, st2;
+			char *k1, *k2;
+
+			U_MAP_EACH(&st1, map, &k1, NULL) {
+				printf("%s:", k1);
+				U_MAP_EACH(&st2, map, &k2, NULL)
+					printf(" %s", k2);
+				printf("\n");
+			}
 			break;
 		}
 
@@ -55,17 +173,21 @@ int main(int argc, char *argv[])
 				break;
 			}
 			*p++ = '\0';
-			u_map_set(map, s+1, strdup(p));
+			u_map_set(map, key(s+1), strdup(p));
+			break;
+
+		case '0': /* insert with a NULL value */
+			u_map_set(map, key(s+1), NULL);
 			break;
 
 		case '-': /* delete */
-			p = u_map_del(map, s+1);
-			puts(p);
+			p = u_map_del(map, key(s+1));
+			puts(p ? p : "");
 			free(p);
 			break;
 
 		case '?': /* test */
-			puts(u_map_get(map, s+1) == NULL ? "no" : "yes");
+			puts(u_map_get(map, key(s+1)) == NULL ? "no" : "yes");
 			break;
 
 		case '*': /* debug */
@@ -73,7 +195,7 @@ int main(int argc, char *argv[])
 			break;
 
 		case '=': /* get */
-			p = u_map_get(map, s+1);
+			p = u_map_get(map, key(s+1));
 			puts(p ? p : "");
 			break;
 
@@ -2,8 +2,12 @@
 
 function run_test {
   echo "run $1"
-  ./map < $1 2>/dev/null | diff -rupN - $1.out
+  ./map $2 < $1 2>/dev/null | diff -rupN - $1.out
 }
 
 for i in test*.txt; do
   run_test $i; done
+
+# the same map, as MAP_HASHED
+for i in htest*.txt; do
+  run_test $i -h; done
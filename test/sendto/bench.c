@@ -0,0 +1,326 @@
+/* ircd-micro, bench.c -- visible fan-out benchmark
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Replays a netsplit through the server's own code. Real users,
+   channels and servers are created with u_user_create_local,
+   u_user_create_remote, u_server_make_sreg and u_chan_user_add, and the
+   link to the server that goes away is killed with u_link_fatal, which
+   goes through exceptional_quit and u_server_destroy exactly as a dead
+   socket would. For comparison, the same split is also replayed the way
+   it used to be done, a u_sendto_visible QUIT and u_user_destroy per
+   lost user. NICK-style u_sendto_visible calls are timed too, along
+   with how many recipient entries they scan for each recipient that
+   actually gets the line.
+
+   Only the accept path and the event loop are skipped. Each link is
+   given a u_conn by hand on one end of a socketpair, whose other end is
+   drained between runs, and write_all stands in for the writes at the
+   end of a loop iteration. */
+
+#include "ircd.h"
+#include <sys/resource.h>
+
+#define NUM_CHANS      500
+#define NUM_LOCAL      1000
+#define NUM_SPLIT      10000 /* behind the server that goes away */
+#define NUM_REMOTE     10000 /* behind a server that stays */
+#define CHANS_PER_USER 10
+
+struct timeval NOW;
+
+void sync_time(void)
+{
+	gettimeofday(&NOW, NULL);
+}
+
+/* the rest of what main.c would have provided */
+mowgli_eventloop_t *base_ev;
+mowgli_dns_t *base_dns;
+u_ts_t started;
+char startedstr[256];
+ushort opt_port = 0;
+char *main_argv0 = "bench";
+
+static u_link *local_links[NUM_LOCAL];
+static int peers[NUM_LOCAL + 16];
+static int npeers = 0;
+
+static u_user *users[NUM_LOCAL + NUM_SPLIT + NUM_REMOTE];
+static u_server *sv_split, *sv_stay;
+static u_link *link_split, *link_stay;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static u_link *bench_link(void)
+{
+	u_link *link;
+	u_conn *conn;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	set_nonblocking(sv[0]);
+	set_nonblocking(sv[1]);
+	peers[npeers++] = sv[1];
+
+	link = calloc(1, sizeof(*link));
+	conn = calloc(1, sizeof(*conn));
+
+	conn->state = U_CONN_ACTIVE;
+	conn->poll = mowgli_pollable_create(base_ev, sv[0], conn);
+	strcpy(conn->ip, "127.0.0.1");
+	strcpy(conn->host, "localhost");
+	u_sendq_init(&conn->sendq);
+	conn->ctx = &u_link_conn_ctx;
+	conn->priv = link;
+
+	link->conn = conn;
+	link->type = LINK_NONE;
+	u_ibuf_init(&link->ibuf, IBUFSIZE, IBUFSIZE);
+	link->sendto_id = u_sendto_id_new();
+
+	return link;
+}
+
+/* bytes that reached the local users' sockets since the last call */
+static ulong drain(void)
+{
+	static char buf[65536];
+	ulong total = 0;
+	ssize_t sz;
+	int i;
+
+	for (i=0; i<npeers; i++) {
+		while ((sz = read(peers[i], buf, sizeof(buf))) > 0)
+			total += sz;
+	}
+
+	return total;
+}
+
+/* what flush_output does at the end of a loop iteration */
+static void write_all(void)
+{
+	u_conn *conn;
+	int i;
+
+	for (i=0; i<NUM_LOCAL; i++) {
+		conn = local_links[i]->conn;
+		u_sendq_flush(&conn->sendq, conn->poll->fd);
+	}
+}
+
+static void clear_all(void)
+{
+	int i;
+
+	for (i=0; i<NUM_LOCAL; i++)
+		u_conn_sendq_clear(local_links[i]->conn);
+	drain();
+}
+
+static u_server *bench_server(u_link **linkp, char *sid)
+{
+	*linkp = bench_link();
+	u_server_make_sreg(*linkp, sid);
+
+	return (*linkp)->priv;
+}
+
+static u_user *bench_user(int i)
+{
+	char buf[16];
+	u_user *u;
+
+	if (i < NUM_LOCAL) {
+		local_links[i]->type = LINK_NONE;
+		local_links[i]->priv = NULL;
+		u = u_user_create_local(local_links[i]);
+	} else if (i < NUM_LOCAL + NUM_SPLIT) {
+		snprintf(buf, sizeof(buf), "%s%06d", sv_split->sid, i);
+		u = u_user_create_remote(sv_split, buf);
+	} else {
+		snprintf(buf, sizeof(buf), "%s%06d", sv_stay->sid, i);
+		u = u_user_create_remote(sv_stay, buf);
+	}
+
+	snprintf(buf, sizeof(buf), "u%d", i);
+	u_user_set_nick(u, buf, NOW.tv_sec);
+	u_user_set_ident(u, "bench");
+	u_user_set_host(u, "bench.example.org");
+
+	return u;
+}
+
+static void build_world(void)
+{
+	char name[MAXCHANNAME+1];
+	u_chan *c;
+	int i, j;
+
+	srand(1);
+
+	sv_split = bench_server(&link_split, "1AA");
+	sv_stay = bench_server(&link_stay, "2AA");
+
+	for (i=0; i<arraylen(users); i++) {
+		users[i] = bench_user(i);
+
+		for (j=0; j<CHANS_PER_USER; j++) {
+			snprintf(name, sizeof(name), "#c%d", rand() % NUM_CHANS);
+			if ((c = u_chan_get(name)) == NULL)
+				c = u_chan_create(name);
+			if (u_chan_user_find(c, users[i]) == NULL)
+				u_chan_user_add(c, users[i]);
+		}
+	}
+}
+
+/* whatever the split left behind */
+static void free_world(void)
+{
+	int i;
+
+	for (i=0; i<NUM_LOCAL; i++)
+		u_user_destroy(users[i]);
+	for (i=NUM_LOCAL+NUM_SPLIT; i<arraylen(users); i++)
+		u_user_destroy(users[i]);
+
+	u_server_destroy(sv_stay);
+	clear_all();
+}
+
+static ulong lines_queued(void)
+{
+	ulong n = 0;
+	int i;
+
+	for (i=0; i<NUM_LOCAL; i++)
+		n += local_links[i]->conn->out_lines;
+
+	return n;
+}
+
+static void run_visible(void)
+{
+	ulong scanned = 0, sent;
+	u_chanuser *cu;
+	double t;
+	int i, ci;
+
+	build_world();
+
+	for (i=0; i<arraylen(users); i++) {
+		U_USER_EACH_CHAN(users[i], ci, cu)
+			scanned += cu->c->nlocal;
+	}
+
+	sent = lines_queued();
+	t = now();
+	for (i=0; i<arraylen(users); i++) {
+		u_sendto_visible(users[i], ST_USERS, ":%H NICK :%s",
+		                 users[i], users[i]->nick);
+	}
+	t = now() - t;
+	sent = lines_queued() - sent;
+
+	printf("%-24s %8.2f ms  %6.0f ns/call  %5.1f scanned per recipient\n",
+	       "visible NICK", t * 1000, t * 1e9 / arraylen(users),
+	       (double)scanned / sent);
+
+	u_link_fatal(link_split, "bench");
+	free_world();
+}
+
+/* the way u_server_destroy used to take the users with it */
+static void split_per_user(void)
+{
+	int i;
+
+	for (i=NUM_LOCAL; i<NUM_LOCAL+NUM_SPLIT; i++) {
+		u_sendto_visible(users[i], ST_USERS, ":%H QUIT :%s",
+		                 users[i], "*.net *.split");
+		u_user_destroy(users[i]);
+	}
+
+	u_server_destroy(sv_split);
+}
+
+static void split_fatal(void)
+{
+	u_link_fatal(link_split, "bench");
+}
+
+/* the split is timed up to the point where its output has been written,
+   since the per-user QUITs sit in the sendqs until then while
+   u_sendto_split writes each recipient's straight away. a socket that
+   won't take everything leaves the rest queued, which is counted too */
+static void run_split(const char *name, void (*split)(void))
+{
+	ulong bytes = 0;
+	double t;
+	int i;
+
+	build_world();
+	clear_all();
+
+	t = now();
+	split();
+	write_all();
+	t = now() - t;
+
+	bytes = drain();
+	for (i=0; i<NUM_LOCAL; i++)
+		bytes += local_links[i]->conn->sendq.size;
+
+	printf("%-24s %8.2f ms  %9lu bytes of QUITs\n", name, t * 1000, bytes);
+
+	free_world();
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit rl;
+	int i;
+
+	sync_time();
+	u_log_level = LG_WARN;
+
+	/* a socket pair per local user */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	base_ev = mowgli_eventloop_create();
+
+	if (init_util() < 0 || init_hook() < 0 || init_conf() < 0 ||
+	    init_sendq() < 0 || init_conn() < 0 || init_server() < 0 ||
+	    init_user() < 0 || init_chan() < 0 || init_sendto() < 0 ||
+	    init_link() < 0) {
+		printf("init failed\n");
+		return 1;
+	}
+
+	for (i=0; i<NUM_LOCAL; i++)
+		local_links[i] = bench_link();
+
+	printf("%d channels, %d local users, %d split, %d staying, "
+	       "%d channels each\n", NUM_CHANS, NUM_LOCAL, NUM_SPLIT,
+	       NUM_REMOTE, CHANS_PER_USER);
+
+	run_visible();
+	run_split("split, visible per user", split_per_user);
+	run_split("split, exceptional_quit", split_fatal);
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/* ircd-micro, bench.c -- format benchmark
+   Copyright (C) 2015 ircd-micro contributors
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Runs a mix of the formats that dominate real traffic through vsnf,
+   once with the interpreter and once with compiled formats, and checks
+   that both produce the same output. The mix is weighted roughly like
+   a busy server: mostly channel messages, then joins and numerics. */
+
+#include "ircd.h"
+
+#define ROUNDS 2000000
+
+static u_user user;
+static u_chan chan;
+static u_server server;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static char *text = "so I was thinking about the ircd, and the formatter";
+
+/* returns the number of bytes formatted */
+static ulong mix(int i, char *buf)
+{
+	switch (i % 10) {
+	case 0: case 1: case 2: case 3: case 4:
+		return snf(FMT_USER, buf, 512, ":%H PRIVMSG %C :%s",
+		           &user, &chan, text);
+	case 5:
+		return snf(FMT_SERVER, buf, 512, ":%H PRIVMSG %C :%s",
+		           &user, &chan, text);
+	case 6:
+		return snf(FMT_USER, buf, 512, ":%H JOIN %C", &user, &chan);
+	case 7:
+		return snf(FMT_USER, buf, 512, ":%S %03d %s %s",
+		           &server, 372, user.nick, ":- welcome to the network");
+	case 8:
+		/* RPL_WHOREPLY */
+		return snf(FMT_USER, buf, 512, "%C %s %s %s %s %s :%d %s",
+		           &chan, user.ident, user.host, server.name,
+		           user.nick, "H@", 0, user.gecos);
+	default:
+		/* RPL_NAMREPLY */
+		return snf(FMT_USER, buf, 512, "%c %C :%s", '=', &chan,
+		           "@alice +bob carol dave eve mallory trent");
+	}
+}
+
+static double run(bool compiled, ulong *bytes)
+{
+	char buf[512];
+	double t;
+	int i;
+
+	vsnf_compiled = compiled;
+	*bytes = 0;
+
+	t = now();
+	for (i=0; i<ROUNDS; i++)
+		*bytes += mix(i, buf);
+	return now() - t;
+}
+
+static int check(void)
+{
+	char a[512], b[512];
+	int i;
+
+	for (i=0; i<10; i++) {
+		vsnf_compiled = false;
+		mix(i, a);
+		vsnf_compiled = true;
+		mix(i, b);
+
+		if (strcmp(a, b)) {
+			printf("mismatch:\n  %s\n  %s\n", a, b);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void report(const char *name, double t, ulong bytes)
+{
+	printf("%-12s %8.1f ns/call  %6.1f MB/s\n", name,
+	       t * 1e9 / ROUNDS, bytes / t / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	ulong bytes;
+	double t;
+
+	strcpy(user.uid, "22UAAAAAB");
+	strcpy(user.nick, "somebody");
+	strcpy(user.ident, "~someone");
+	strcpy(user.host, "host-203-0-113-7.example.net");
+	strcpy(user.gecos, "Some Body");
+	strcpy(chan.name, "#ircd-micro");
+	strcpy(server.sid, "22U");
+	strcpy(server.name, "irc.example.net");
+
+	if (check() < 0)
+		return 1;
+
+	printf("%d calls\n", ROUNDS);
+
+	t = run(false, &bytes);
+	report("interpreted", t, bytes);
+
+	t = run(true, &bytes);
+	report("compiled", t, bytes);
+
+	return 0;
+}